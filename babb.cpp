@@ -0,0 +1,61 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+//----------------------------------------------------------------------------
+//
+//  The one definition of babb's process-wide and per-thread state.
+//
+//  Everything else in babb.h is inline, so babb.h can be included anywhere;
+//  this file must be linked in exactly once, directly or as part of the babb
+//  library (see CMakeLists.txt). When babb is a shared library, every module
+//  that links against it shares this state.
+//
+//----------------------------------------------------------------------------
+
+#include "babb.h"
+
+namespace babb {
+
+namespace detail {
+    std::atomic<nanos> phase_end{0};
+    std::atomic<injection_logger> log_injection{nullptr};
+
+    std::atomic<std::uint64_t> oom_epoch{0};
+    std::atomic<nanos> oom_end{0};
+
+    BABB_TLS std::int64_t free_credit = publish_interval;
+    BABB_TLS std::uint64_t freed_published = 0;
+    std::atomic<std::uint64_t> freed_everywhere{0};
+    std::atomic<std::uint64_t> recovery_target{0};
+
+    std::atomic<bool> unwind_costs_on{false};
+    unwind_costs::site_costs unwind_sites[unwind_costs::max_sites];
+    std::atomic<std::uint64_t> unwind_overflow{0};
+    BABB_TLS in_flight_failure in_flight;
+
+    std::atomic<bool> fail_while_unwinding{false};
+    unwind_allocations::site_count unwinding_sites[unwind_allocations::max_sites];
+    std::atomic<std::uint64_t> unwinding_total{0};
+}
+
+state shared;
+mapping_options mapping;
+
+BABB_TLS this_thread_ this_thread;
+
+}
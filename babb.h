@@ -23,24 +23,509 @@
 #include <limits>
 #include <random>
 #include <cassert>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// Thread-local variables that the injection check and the replacement
+// operator new/delete touch on every call use the initial-exec TLS model
+// where available: a fixed offset from the thread pointer, with no
+// initialization check or call, even from a shared library. They are all
+// constant-initialized for that reason.
+#if defined(__GNUC__) && !defined(_WIN32)
+#define BABB_TLS __thread __attribute__((tls_model("initial-exec")))
+#else
+#define BABB_TLS thread_local
+#endif
+
+// The call site of an allocation or injected failure; only exact in a
+// function that is never inlined, so such functions are marked BABB_NOINLINE
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BABB_RETURN_ADDRESS() _ReturnAddress()
+#define BABB_NOINLINE __declspec(noinline)
+#else
+#define BABB_RETURN_ADDRESS() __builtin_return_address(0)
+#define BABB_NOINLINE __attribute__((noinline))
+#endif
+
+// Static tracepoints (USDT) in provider "babb", for perf, bpftrace and
+// SystemTap (see README). Each probe has a semaphore that tracers raise while
+// attached; until then a probe site costs a load and an untaken branch, and
+// its arguments are not computed. Every module that includes babb.h gets its
+// own hidden copy of the semaphores, as USDT expects. All arguments are
+// passed as 64-bit unsigned values. Define BABB_NO_PROBES to leave them out.
+#if defined(__linux__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__)) && !defined(BABB_NO_PROBES)
+#define BABB_HAS_PROBES 1
+
+#define BABB_PROBE_SEMAPHORE(name)                                              \
+    ".ifndef babb_" #name "_semaphore\n"                                       \
+    ".pushsection .probes,\"awG\",\"progbits\",babb_" #name "_semaphore,comdat\n" \
+    ".weak babb_" #name "_semaphore\n"                                         \
+    ".hidden babb_" #name "_semaphore\n"                                       \
+    ".balign 2\n"                                                              \
+    "babb_" #name "_semaphore: .2byte 0\n"                                     \
+    ".popsection\n"                                                            \
+    ".endif\n"
+
+// The probe site (a nop) and its .note.stapsdt entry, as <sys/sdt.h> lays them out
+#define BABB_PROBE_NOTE(name, args)                                             \
+    "990: nop\n"                                                               \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                              \
+    ".balign 4\n"                                                              \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                         \
+    "991: .asciz \"stapsdt\"\n"                                                \
+    "992: .balign 4\n"                                                         \
+    "993: .8byte 990b\n"                                                       \
+    ".8byte _.stapsdt.base\n"                                                  \
+    ".8byte babb_" #name "_semaphore\n"                                        \
+    ".asciz \"babb\"\n"                                                        \
+    ".asciz \"" #name "\"\n"                                                   \
+    ".asciz \"" args "\"\n"                                                    \
+    "994: .balign 4\n"                                                         \
+    ".popsection\n"                                                            \
+    ".ifndef _.stapsdt.base\n"                                                 \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"    \
+    ".weak _.stapsdt.base\n"                                                   \
+    ".hidden _.stapsdt.base\n"                                                 \
+    "_.stapsdt.base: .space 1\n"                                               \
+    ".size _.stapsdt.base, 1\n"                                                \
+    ".popsection\n"                                                            \
+    ".endif\n"
+
+#define BABB_PROBE_ENABLED(name) __builtin_expect(babb_##name##_semaphore != 0, 0)
+
+#define BABB_PROBE_ARG(n, x) [a##n] "nor" (babb::detail::probe_value(x))
+
+#define BABB_PROBE2(name, x1, x2)                                               \
+    __asm__ __volatile__(BABB_PROBE_NOTE(name, "8@%[a1] 8@%[a2]")               \
+        :: BABB_PROBE_ARG(1, x1), BABB_PROBE_ARG(2, x2))
+#define BABB_PROBE3(name, x1, x2, x3)                                           \
+    __asm__ __volatile__(BABB_PROBE_NOTE(name, "8@%[a1] 8@%[a2] 8@%[a3]")       \
+        :: BABB_PROBE_ARG(1, x1), BABB_PROBE_ARG(2, x2), BABB_PROBE_ARG(3, x3))
+#define BABB_PROBE4(name, x1, x2, x3, x4)                                       \
+    __asm__ __volatile__(BABB_PROBE_NOTE(name, "8@%[a1] 8@%[a2] 8@%[a3] 8@%[a4]") \
+        :: BABB_PROBE_ARG(1, x1), BABB_PROBE_ARG(2, x2), BABB_PROBE_ARG(3, x3), BABB_PROBE_ARG(4, x4))
+
+extern "C" {
+    __attribute__((visibility("hidden"))) extern volatile unsigned short babb_decide_semaphore;
+    __attribute__((visibility("hidden"))) extern volatile unsigned short babb_inject_semaphore;
+    __attribute__((visibility("hidden"))) extern volatile unsigned short babb_new_semaphore;
+    __attribute__((visibility("hidden"))) extern volatile unsigned short babb_delete_semaphore;
+}
+__asm__(BABB_PROBE_SEMAPHORE(decide) BABB_PROBE_SEMAPHORE(inject)
+        BABB_PROBE_SEMAPHORE(new) BABB_PROBE_SEMAPHORE(delete));
+
+#else
+#define BABB_PROBE_ENABLED(name) false
+#define BABB_PROBE2(name, x1, x2) ((void)0)
+#define BABB_PROBE3(name, x1, x2, x3) ((void)0)
+#define BABB_PROBE4(name, x1, x2, x3, x4) ((void)0)
+#endif
 
 namespace babb {
 
+//----------------------------------------------------------------------------
+//  Coarse monotonic time
+//
+//  Injection decisions never read the clock directly: each state caches its
+//  effective profile and refreshes it from steady_clock (a vDSO read on Linux,
+//  not a syscall) once every clock_refresh_interval checks.
+//----------------------------------------------------------------------------
+
+namespace detail {
+    typedef std::int64_t nanos;
+
+    // Probe arguments (see BABB_PROBE2 and friends)
+    inline std::uint64_t probe_value(std::uint64_t n) noexcept { return n; }
+    inline std::uint64_t probe_value(const volatile void* p) noexcept
+        { return reinterpret_cast<std::uintptr_t>(p); }
+
+    const int clock_refresh_interval = 64;
+
+    inline nanos monotonic_now() noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // End of the current phase window (see begin_phase), 0 if none
+    extern std::atomic<nanos> phase_end;
+
+    // Where report_injection sends failures while babb::injection_log is
+    // running (see babb_log.h), else nullptr
+    typedef void (*injection_logger)(std::size_t size, unsigned path, const void* site);
+    extern std::atomic<injection_logger> log_injection;
+
+    // The exception for inject_random_failure<E>(size)
+    template<class E>
+    typename std::enable_if<std::is_constructible<E, std::size_t>::value, E>::type
+    make_failure(std::size_t size) { return E(size); }
+
+    template<class E>
+    typename std::enable_if<!std::is_constructible<E, std::size_t>::value, E>::type
+    make_failure(std::size_t) { return E(); }
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	begin_phase/end_phase: Open or close a process-wide phase window.
+//
+//	Schedules created with schedule::during_phases use their profile only
+//  while a phase window is open, e.g. from the start of a load test step.
+//
+//  length:  how long the window stays open unless end_phase is called first
+//
+//----------------------------------------------------------------------------
+
+inline void begin_phase(std::chrono::nanoseconds length) noexcept {
+    detail::phase_end.store(detail::monotonic_now() + length.count(), std::memory_order_relaxed);
+}
+
+inline void end_phase() noexcept {
+    detail::phase_end.store(0, std::memory_order_relaxed);
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	raise_oom_event/end_oom_event: Make every participating thread fail for a
+//  while, or stop early.
+//
+//	Threads whose state has set_oom_events fail every allocation from their
+//  next one until the window ends, as when a whole process runs out of
+//  memory at once. Those threads also raise events themselves, at their
+//  fail_once_per rate; this function raises one by hand.
+//
+//  Outside events, the injection check only compares one relaxed atomic
+//  load with a value cached in the thread's context, so participating costs
+//  nothing measurable and causes no cache-line traffic.
+//
+//  window:  how long the event lasts
+//
+//----------------------------------------------------------------------------
+
+namespace detail {
+    extern std::atomic<std::uint64_t> oom_epoch;    // bumped when an event starts
+    extern std::atomic<nanos> oom_end;              // end of the latest event
+}
+
+inline void raise_oom_event(std::chrono::nanoseconds window) noexcept {
+    detail::oom_end.store(detail::monotonic_now() + window.count(), std::memory_order_relaxed);
+    detail::oom_epoch.fetch_add(1, std::memory_order_release);
+}
+
+inline void end_oom_event() noexcept {
+    detail::oom_end.store(0, std::memory_order_relaxed);
+}
+
+
+//----------------------------------------------------------------------------
+//
+//	schedule: Vary the failure profile over time.
+//
+//	The default schedule always uses the state's failure profile. The others
+//  override the profile during some time windows, measured from when the
+//  schedule object was created:
+//
+//  warmup(length):               no failures at all for the first length
+//  bursts(every, length, per):   fail once per "per" allocations for length
+//                                  at the start of every period "every"
+//  ramp(length, from, to):       move the failure rate linearly from once per
+//                                  "from" to once per "to" allocations over
+//                                  length, then stay at "to" (from may be 0,
+//                                  meaning no failures)
+//  during_phases(per):           fail once per "per" allocations while a
+//                                  begin_phase window is open
+//
+//  Outside of its windows a schedule falls back to the state's failure profile,
+//  so set that to a large fail_once_per if you want quiet periods.
+//
+//----------------------------------------------------------------------------
+
+class schedule {
+    enum class kind { steady, warmup, bursts, ramp, phases };
+
+    kind k = kind::steady;
+    detail::nanos start = 0;
+    detail::nanos period = 0;
+    detail::nanos length = 0;
+    int from_once_per = 0;
+    int to_once_per = 0;
+
+    schedule(kind k_, std::chrono::nanoseconds period_, std::chrono::nanoseconds length_, int from, int to) noexcept
+        : k(k_), start(detail::monotonic_now()), period(period_.count()), length(length_.count())
+        , from_once_per(from), to_once_per(to)
+        { assert(period >= 0 && length >= 0 && from >= 0 && to >= 0); }
+
+public:
+    constexpr schedule() noexcept { }
+
+    static schedule warmup(std::chrono::nanoseconds length) noexcept
+        { return schedule(kind::warmup, std::chrono::nanoseconds(0), length, 0, 0); }
+
+    static schedule bursts(std::chrono::nanoseconds every, std::chrono::nanoseconds length, int fail_once_per) noexcept
+        { assert(every.count() > 0); return schedule(kind::bursts, every, length, fail_once_per, fail_once_per); }
+
+    static schedule ramp(std::chrono::nanoseconds length, int from_once_per, int to_once_per) noexcept
+        { return schedule(kind::ramp, std::chrono::nanoseconds(0), length, from_once_per, to_once_per); }
+
+    static schedule during_phases(int fail_once_per) noexcept
+        { return schedule(kind::phases, std::chrono::nanoseconds(0), std::chrono::nanoseconds(0), fail_once_per, fail_once_per); }
+
+    // Effective avg #allocations between failures at time now (0 = no failures)
+    int once_per_at(detail::nanos now, int base_once_per) const noexcept {
+        auto elapsed = now - start;
+        switch (k) {
+        case kind::warmup:
+            return elapsed < length ? 0 : base_once_per;
+        case kind::bursts:
+            return elapsed % period < length ? to_once_per : base_once_per;
+        case kind::ramp: {
+            if (elapsed >= length) return to_once_per;
+            // interpolate the failure rate, not the interval
+            double from = from_once_per ? 1./from_once_per : 0.;
+            double to   = to_once_per   ? 1./to_once_per   : 0.;
+            double rate = from + (to - from) * elapsed / length;
+            return rate > 0. ? int(1./rate) : 0;
+        }
+        case kind::phases:
+            return now < detail::phase_end.load(std::memory_order_relaxed) ? to_once_per : base_once_per;
+        default:
+            return base_once_per;
+        }
+    }
+};
+
+
+//----------------------------------------------------------------------------
+//  Allocation paths that failures can be targeted at
+//
+//  heap:    ordinary allocations; this is what your own allocation functions
+//           report when they call should_inject_random_failure()
+//  mapped:  large allocations that new_replacements.cpp serves directly from
+//           mmap, where an injected failure is reported as mmap's ENOMEM
+//----------------------------------------------------------------------------
+
+struct paths {
+    enum : unsigned { heap = 1, mapped = 2, all = heap | mapped };
+};
+
+
+//----------------------------------------------------------------------------
+//
+//  Run-length policies: how long a failure run lasts once it has started.
+//
+//  The policy is chosen at compile time, so it inlines into the injection
+//  check. To pick one, define BABB_RUN_LENGTH_POLICY the same way in every
+//  translation unit that includes this header (including new_replacements.cpp),
+//  e.g. -DBABB_RUN_LENGTH_POLICY=babb::run_lengths::geometric. The default is
+//  uniform.
+//
+//  A policy is a small value type with:
+//      static double mean(int n)       average failures per run, so that
+//                                      fail_once_per stays the average rate
+//      void begin(int n, double u)     start a run; n is the profile's
+//                                      run_length, u is uniform in (0,1]
+//      bool running() const            is a run in progress
+//      void step()                     one failure has been injected
+//      static const bool counts_frees  whether freed() needs to be called
+//      void freed(std::size_t bytes)   memory was released on this thread
+//
+//----------------------------------------------------------------------------
+
+namespace run_lengths {
+
+    // Every run is exactly run_length failures
+    struct fixed {
+        int left = 0;
+        static double mean(int n) noexcept { return n; }
+        void begin(int n, double) noexcept { left = n; }
+        bool running() const noexcept { return left > 0; }
+        void step() noexcept { --left; }
+        static const bool counts_frees = false;
+        void freed(std::size_t) noexcept { }
+    };
+
+    // Uniform in [1, run_length]
+    struct uniform {
+        int left = 0;
+        static double mean(int n) noexcept { return (n + 1) / 2.; }
+        void begin(int n, double u) noexcept { left = u < 1. ? 1 + int(u * n) : n; }
+        bool running() const noexcept { return left > 0; }
+        void step() noexcept { --left; }
+        static const bool counts_frees = false;
+        void freed(std::size_t) noexcept { }
+    };
+
+    // Geometric with mean run_length: after each failure the run goes on
+    // with the same probability, so long runs are rare but unbounded
+    struct geometric {
+        int left = 0;
+        static double mean(int n) noexcept { return n; }
+        void begin(int n, double u) noexcept {
+            double length = n > 1 ? 1. + std::floor(std::log(u) / std::log(1. - 1. / n)) : 1.;
+            left = length < 1e9 ? int(length) : 1000000000;
+        }
+        bool running() const noexcept { return left > 0; }
+        void step() noexcept { --left; }
+        static const bool counts_frees = false;
+        void freed(std::size_t) noexcept { }
+    };
+
+    // Every allocation fails until run_length blocks have been freed on this
+    // thread, like a real out-of-memory condition that lasts until someone
+    // gives memory back. The mean assumes about one allocation per free, so
+    // the failure rate only approximately follows fail_once_per.
+    struct until_frees {
+        int frees_left = 0;
+        static double mean(int n) noexcept { return n; }
+        void begin(int n, double) noexcept { frees_left = n; }
+        bool running() const noexcept { return frees_left > 0; }
+        void step() noexcept { }
+        static const bool counts_frees = true;
+        void freed(std::size_t) noexcept { if (frees_left > 0) --frees_left; }
+    };
+
+}
+
+#ifndef BABB_RUN_LENGTH_POLICY
+#define BABB_RUN_LENGTH_POLICY babb::run_lengths::uniform
+#endif
+
+typedef BABB_RUN_LENGTH_POLICY run_length_policy;
+
+
+//----------------------------------------------------------------------------
+//
+//	released: Report memory given back, for free-driven recovery (set_recovery).
+//
+//	The replacement operator delete calls this for every block it frees; call
+//  it from your own deallocation functions too if they return memory that
+//  their allocation functions would otherwise fail for lack of.
+//
+//  This is on every deallocation, so in the common case it is one subtract
+//  from a thread-local credit. Only when the credit runs out (every
+//  publish_interval bytes) is the thread's total added to the process-wide
+//  one, so process-wide recovery sees frees with at most that much lag per
+//  thread.
+//
+//----------------------------------------------------------------------------
+
+namespace detail {
+    const std::int64_t publish_interval = std::int64_t(64) << 10;
+
+    extern BABB_TLS std::int64_t free_credit;           // starts at publish_interval
+    extern BABB_TLS std::uint64_t freed_published;      // this thread's, so far
+    extern std::atomic<std::uint64_t> freed_everywhere;
+
+    // Process-wide recovery: nonzero while a run is waiting for
+    // freed_everywhere to reach this value
+    extern std::atomic<std::uint64_t> recovery_target;
+
+    inline void publish_frees() noexcept {
+        std::uint64_t bytes = std::uint64_t(publish_interval - free_credit);
+        freed_published += bytes;
+        freed_everywhere.fetch_add(bytes, std::memory_order_relaxed);
+        free_credit = publish_interval;
+    }
+
+    inline std::uint64_t freed_on_this_thread() noexcept {
+        return freed_published + std::uint64_t(publish_interval - free_credit);
+    }
+}
+
+inline void released(std::size_t bytes) noexcept {
+    if ((detail::free_credit -= std::int64_t(bytes)) < 0)
+        detail::publish_frees();
+}
+
+enum class recovery { this_thread, process };
+
+
+//----------------------------------------------------------------------------
+//
+//	Latency injection (see set_delay_profile)
+//
+//  delays::shape:   how the length of each delay is drawn: fixed (always the
+//                   mean), uniform (between zero and twice the mean) or
+//                   exponential (mostly short, now and then many times the
+//                   mean, like the stalls of a real allocator)
+//  delays::method:  spin (busy-wait, holding the CPU as a contended allocator
+//                   lock would) or sleep (giving it up, as a page fault or a
+//                   compaction would)
+//
+//----------------------------------------------------------------------------
+
+namespace delays {
+    enum shape : unsigned char { fixed, uniform, exponential };
+    enum method : unsigned char { spin, sleep };
+}
+
+namespace detail {
+    inline void stall(nanos length, delays::method how) noexcept {
+        if (how == delays::sleep) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(length));
+            return;
+        }
+        for (nanos until = monotonic_now() + length; monotonic_now() < until; ) { }
+    }
+}
+
+
 //----------------------------------------------------------------------------
 //  State values to control failure frequency and status
 //  We'll keep a global state, and a per-thread state
 //----------------------------------------------------------------------------
 
 class state {
+    friend class pause_guard;
+    friend class profile_guard;
+    friend class state_guard;
+
 protected:
     int once_per  = 100000;    	// avg #allocations between failures
-    int run_length = 5;	        // max #consecutive failures
+    int run_length = 5;	        // #consecutive failures (see run_lengths)
     bool paused = false;        // is failure injection currently paused
+    int pause_depth = 0;        // #live pause_guards, injection is paused while > 0
+    schedule sched;             // how the profile varies over time
+    unsigned targets = paths::all;  // which allocation paths can fail
+
+    std::uint64_t recover_after = 0;    // bytes to free to end a run, 0 to end runs by length
+    bool recover_process_wide = false;  // count frees on all threads, and fail on all of them
+    detail::nanos oom_window = 0;       // length of process-wide OOM events, 0 if not taking part
+
+    int delay_per = 0;                  // avg #allocations between delays, 0 for none
+    int delay_burst = 1;                // #consecutive allocations delayed once a burst starts
+    detail::nanos delay_mean = 0;       // average length of one delay
+    delays::shape delay_shape = delays::fixed;
+    delays::method delay_method = delays::spin;
+    std::size_t delay_min_size = 0;     // only requests of this many bytes...
+    std::size_t delay_max_size = std::numeric_limits<std::size_t>::max();  // ...up to this many are delayed
+
+    double trigger = 0.;        // cached chance of starting a new run
+    int until_refresh = 0;      // #checks until trigger is recomputed
 
     // non-auto explicit return type is for portability to pre-C++14 compilers
     bool invariant() noexcept
         { return once_per > 0 && run_length > 0; }
 
+    // Re-evaluate the schedule against the (coarse) current time
+    void refresh_trigger() noexcept {
+        until_refresh = detail::clock_refresh_interval;
+        int per = sched.once_per_at(detail::monotonic_now(), once_per);
+        double mean_run = recover_after || oom_window ? 1. : run_length_policy::mean(run_length);
+        trigger = per > 0 ? 1./per/mean_run : 0.;
+    }
+
 public:
     //----------------------------------------------------------------------------
     //
@@ -52,17 +537,127 @@ public:
     //  Each thread initially defaults to the shared values.
     //
     //  fail_once_per:  avg #allocations between failures
-    //  max_run_length: max #consecutive failures (once we have triggered a new one)
+    //  max_run_length: max (or, depending on the run-length policy, mean)
+    //                  #consecutive failures once we have triggered a new one
     //
     //----------------------------------------------------------------------------
 
     void set_failure_profile(int fail_once_per, int max_run_length) noexcept {
         once_per = fail_once_per;
         run_length = max_run_length;
+        until_refresh = 0;
         assert(invariant());
     }
 
 
+    //----------------------------------------------------------------------------
+    //
+    //	set_failure_schedule: Vary the failure profile over time (see schedule).
+    //
+    //  Schedules are evaluated against a clock that is only read once every few
+    //  dozen allocations, so window edges are accurate to that granularity.
+    //
+    //----------------------------------------------------------------------------
+
+    void set_failure_schedule(const schedule& s) noexcept {
+        sched = s;
+        until_refresh = 0;
+    }
+
+
+    //----------------------------------------------------------------------------
+    //
+    //	set_failure_targets: Choose which allocation paths failures are injected on.
+    //
+    //  on_paths:  a combination of paths::heap and paths::mapped (default: all)
+    //
+    //----------------------------------------------------------------------------
+
+    void set_failure_targets(unsigned on_paths) noexcept {
+        targets = on_paths;
+    }
+
+
+    //----------------------------------------------------------------------------
+    //
+    //	set_recovery: End failure runs when memory is released, not after a count.
+    //
+    //	Once a run starts, every allocation keeps failing until bytes more have
+    //  been freed (see released), as in a real out-of-memory condition. With
+    //  recovery::process, frees on any thread count, and every thread whose
+    //  state also uses recovery::process fails until then. fail_once_per is then
+    //  the average #allocations between the starts of such episodes.
+    //
+    //  bytes:  how much must be freed to end a run; 0 ends runs by length again
+    //
+    //----------------------------------------------------------------------------
+
+    void set_recovery(std::uint64_t bytes, recovery scope = recovery::this_thread) noexcept {
+        recover_after = bytes;
+        recover_process_wide = scope == recovery::process;
+        until_refresh = 0;
+    }
+
+
+    //----------------------------------------------------------------------------
+    //
+    //	set_oom_events: Take part in process-wide OOM events (see raise_oom_event).
+    //
+    //	Instead of starting failure runs of its own, this state raises an event
+    //  for everyone taking part, on average once per fail_once_per allocations,
+    //  and fails for as long as any event lasts.
+    //
+    //  window:  how long the events this state raises last; zero to stop
+    //           taking part
+    //
+    //----------------------------------------------------------------------------
+
+    void set_oom_events(std::chrono::nanoseconds window) noexcept {
+        oom_window = window.count();
+        until_refresh = 0;
+    }
+
+
+    //----------------------------------------------------------------------------
+    //
+    //	set_delay_profile: Slow allocations down instead of failing them.
+    //
+    //	The replacement operator new then waits before some allocations, in
+    //  bursts the way failures come in runs, to show how the program copes
+    //  with an allocator that is slow rather than out of memory. Delays and
+    //  failures are independent; set both to get some of each.
+    //
+    //  delay_once_per:  avg #allocations between delays; 0 to stop delaying
+    //  mean_delay:      average length of one delay (see delays::shape)
+    //  burst_length:    #consecutive allocations delayed once a burst starts
+    //  how:             spin or sleep (see delays::method)
+    //  distribution:    how each delay's length is drawn (see delays::shape)
+    //
+    //----------------------------------------------------------------------------
+
+    void set_delay_profile(int delay_once_per, std::chrono::nanoseconds mean_delay, int burst_length = 1,
+                           delays::method how = delays::spin, delays::shape distribution = delays::fixed) noexcept {
+        delay_per = delay_once_per;
+        delay_burst = burst_length > 0 ? burst_length : 1;
+        delay_mean = mean_delay.count();
+        delay_method = how;
+        delay_shape = distribution;
+    }
+
+
+    //----------------------------------------------------------------------------
+    //
+    //	set_delay_sizes: Only delay requests of min_size to max_size bytes.
+    //
+    //----------------------------------------------------------------------------
+
+    void set_delay_sizes(std::size_t min_size,
+                         std::size_t max_size = std::numeric_limits<std::size_t>::max()) noexcept {
+        delay_min_size = min_size;
+        delay_max_size = max_size;
+    }
+
+
     //----------------------------------------------------------------------------
     //
     //	pause: Pause or unpause fault injection on this thread.
@@ -77,6 +672,16 @@ public:
     void pause(bool on) noexcept {
         paused = on;
     }
+
+    // Whether injection is paused by pause(true) or a live pause_guard
+    bool is_paused() const noexcept {
+        return paused || pause_depth > 0;
+    }
+
+    // Whether failure runs end by memory freed (see set_recovery)
+    bool recovers_on_frees() const noexcept {
+        return recover_after != 0;
+    }
 };
 
 //----------------------------------------------------------------------------
@@ -92,7 +697,41 @@ class state_guard {
     state saved;
 public:
     state_guard(state& s) noexcept : original(s), saved(s) { }
-    ~state_guard() noexcept { original = saved; }
+    ~state_guard() noexcept { original = saved; original.until_refresh = 0; }
+};
+
+
+//----------------------------------------------------------------------------
+//
+//	Lightweight RAII helpers that save/restore only what they change
+//
+//	pause_guard pauses injection for its scope at the cost of one increment
+//  and one decrement, and profile_guard sets a failure profile for its scope
+//  and restores just the two profile values. Both nest freely, so they are
+//  the cheap way to wrap every entry point of a library; use state_guard
+//  when a scope may change arbitrary settings.
+//
+//----------------------------------------------------------------------------
+class pause_guard {
+    state& s;
+public:
+    explicit pause_guard(state& st) noexcept : s(st) { ++s.pause_depth; }
+    ~pause_guard() noexcept { --s.pause_depth; }
+    pause_guard(const pause_guard&) = delete;
+    void operator=(const pause_guard&) = delete;
+};
+
+class profile_guard {
+    state& s;
+    int saved_once_per;
+    int saved_run_length;
+public:
+    profile_guard(state& st, int fail_once_per, int max_run_length) noexcept
+        : s(st), saved_once_per(st.once_per), saved_run_length(st.run_length)
+        { s.set_failure_profile(fail_once_per, max_run_length); }
+    ~profile_guard() noexcept { s.once_per = saved_once_per; s.run_length = saved_run_length; s.until_refresh = 0; }
+    profile_guard(const profile_guard&) = delete;
+    void operator=(const profile_guard&) = delete;
 };
 
 
@@ -100,14 +739,326 @@ public:
 //  Global state (used for thread defaults)
 //----------------------------------------------------------------------------
 
-state shared;
+extern state shared;
 
 
 //----------------------------------------------------------------------------
-//  Per-thread state
+//  Options for the mmap-backed large allocation path in new_replacements.cpp
+//  (POSIX only). Set these before starting any threads that allocate.
 //----------------------------------------------------------------------------
 
-class this_thread_ : public state {
+struct mapping_options {
+    std::size_t threshold = 1 << 20;        // requests this large bypass malloc (0 = never)
+    bool transparent_huge_pages = false;    // align to and request 2 MiB pages
+    bool populate = false;                  // prefault the pages (MAP_POPULATE)
+};
+
+extern mapping_options mapping;
+
+
+//----------------------------------------------------------------------------
+//
+//  Resizable page-granular blocks (implemented in new_replacements.cpp)
+//
+//  For large buffers that grow, such as a vector's storage or an I/O
+//  buffer: pages::reallocate grows a block with mremap, which moves page
+//  table entries instead of copying the contents, and shrinks it in place,
+//  returning the freed pages to the OS with madvise(MADV_DONTNEED) and
+//  keeping their address range for the next growth. Blocks are mapped with
+//  the mapping options above.
+//
+//  Failures are injected on paths::mapped where a real system would fail:
+//  when a block is first mapped, and each time reallocate has to grow it
+//  beyond its pages. A failed reallocate returns nullptr and leaves the
+//  block as it was, like realloc; shrinking never fails. Blocks must be
+//  freed with pages::deallocate. Elsewhere than on Linux, this falls back
+//  to malloc and realloc, with failures injected the same way.
+//
+//----------------------------------------------------------------------------
+
+namespace pages {
+    void* allocate(std::size_t size) noexcept;
+    void* reallocate(void* p, std::size_t size) noexcept;
+    void  deallocate(void* p) noexcept;
+}
+
+
+//----------------------------------------------------------------------------
+//
+//  scavenger: return memory cached by new_replacements.cpp to the OS
+//  (implemented there; 64-bit POSIX only, elsewhere start returns false)
+//
+//  The aligned operator new keeps freed blocks in per-thread free lists,
+//  and a thread that exits hands its lists to a shared depot. Left alone,
+//  that memory stays resident for the life of the process. The scavenger
+//  takes the depot's lists, and gives every slab whose blocks are all free
+//  back to the OS with madvise(MADV_DONTNEED), keeping its address range
+//  for reuse. It stops once no more than keep_bytes of free blocks remain.
+//
+//  start() runs a pass every interval on a background thread; scavenge()
+//  runs one on the calling thread. A pass only ever try-locks the depot,
+//  for a constant-time swap of its lists, so it never stalls allocating
+//  threads. It skips a round instead when the depot is busy, or when
+//  another pass is still running.
+//
+//----------------------------------------------------------------------------
+
+namespace scavenger {
+    struct statistics {
+        std::uint64_t passes = 0;
+        std::uint64_t skipped = 0;          // passes that found the depot or another pass busy
+        std::uint64_t slabs_released = 0;
+        std::uint64_t bytes_returned = 0;
+    };
+
+    bool start(std::chrono::milliseconds interval, std::size_t keep_bytes = 0);
+    void stop() noexcept;
+    void scavenge(std::size_t keep_bytes = 0) noexcept;
+    statistics stats() noexcept;
+}
+
+
+//----------------------------------------------------------------------------
+//
+//  unwind_costs: Measure what it costs to recover from injected failures.
+//
+//	While enabled, each failure injected by the replacement operator new or
+//  by inject_random_failure is timestamped as it is thrown, and each catch
+//  handler that calls unwind_costs::caught() closes the measurement. For
+//  every throw site this collects a histogram of the time from throw to
+//  catch, and counts the allocations attempted while unwinding.
+//
+//  Handlers without a probe are noticed too: the next allocation after the
+//  exception is no longer in flight (std::uncaught_exceptions) closes the
+//  measurement, which then is only an upper bound and is counted apart.
+//  Which sites allocate during unwinding is tracked by unwind_allocations.
+//
+//  Recording never allocates: sites go into a fixed table, and throws from
+//  sites beyond its capacity are counted but not itemized.
+//
+//      catch (const std::bad_alloc&) {
+//          babb::unwind_costs::caught();
+//          ...
+//      }
+//
+//----------------------------------------------------------------------------
+
+namespace unwind_costs {
+    const int buckets = 32;         // bucket b counts latencies in [2^b, 2^(b+1)) ns
+    const int max_sites = 256;
+
+    struct site_costs {
+        std::atomic<const void*> site{nullptr};
+        std::atomic<std::uint64_t> throws{0};
+        std::atomic<std::uint64_t> probed{0};       // ended at caught()
+        std::atomic<std::uint64_t> unprobed{0};     // ended at a later allocation
+        std::atomic<std::uint64_t> allocations{0};  // attempted while unwinding
+        std::atomic<std::uint64_t> latency[buckets];
+        site_costs() noexcept { for (auto& b : latency) b.store(0, std::memory_order_relaxed); }
+    };
+}
+
+namespace detail {
+    inline int uncaught() noexcept {
+    #if defined(__cpp_lib_uncaught_exceptions)
+        return std::uncaught_exceptions();
+    #else
+        return std::uncaught_exception() ? 1 : 0;
+    #endif
+    }
+
+    extern std::atomic<bool> unwind_costs_on;
+    extern unwind_costs::site_costs unwind_sites[unwind_costs::max_sites];
+    extern std::atomic<std::uint64_t> unwind_overflow;  // throws from sites that did not fit
+
+    // The injected exception currently in flight on this thread, if any
+    struct in_flight_failure {
+        bool active = false;
+        int uncaught_before = 0;    // std::uncaught_exceptions() just before the throw
+        nanos thrown_at = 0;
+        unwind_costs::site_costs* site = nullptr;
+        std::uint64_t allocations = 0;
+    };
+    extern BABB_TLS in_flight_failure in_flight;
+
+    // Finds or claims the slot for site in a fixed table of slots that have
+    // an atomic site member; nullptr if the table is full
+    template<class Slot, std::size_t N>
+    Slot* site_slot(Slot (&table)[N], const void* site) noexcept {
+        std::size_t h = std::size_t((reinterpret_cast<std::uintptr_t>(site) >> 4) * 0x9E3779B97F4A7C15ull >> 8);
+        for (std::size_t probe = 0; probe < N; ++probe) {
+            Slot& s = table[(h + probe) % N];
+            const void* seen = s.site.load(std::memory_order_acquire);
+            if (seen == site) return &s;
+            if (!seen && (s.site.compare_exchange_strong(seen, site, std::memory_order_acq_rel) || seen == site))
+                return &s;
+        }
+        return nullptr;
+    }
+
+    inline void end_unwind(bool probed) noexcept {
+        in_flight.active = false;
+        unwind_costs::site_costs* s = in_flight.site;
+        if (!s) return;
+        std::uint64_t ns = std::uint64_t(monotonic_now() - in_flight.thrown_at);
+        int b = 0;
+        while (b < unwind_costs::buckets - 1 && (ns >> (b + 1)) != 0) ++b;
+        s->latency[b].fetch_add(1, std::memory_order_relaxed);
+        (probed ? s->probed : s->unprobed).fetch_add(1, std::memory_order_relaxed);
+        s->allocations.fetch_add(in_flight.allocations, std::memory_order_relaxed);
+    }
+
+    // Called just before an injected failure is thrown. The in-flight flag
+    // is always kept (see unwind_allocations); costs only when enabled.
+    inline void begin_unwind(const void* site) noexcept {
+        if (in_flight.active) end_unwind(false);
+        unwind_costs::site_costs* s = nullptr;
+        if (unwind_costs_on.load(std::memory_order_relaxed)) {
+            s = site_slot(unwind_sites, site);
+            if (s) s->throws.fetch_add(1, std::memory_order_relaxed);
+            else unwind_overflow.fetch_add(1, std::memory_order_relaxed);
+        }
+        in_flight.site = s;
+        in_flight.allocations = 0;
+        in_flight.uncaught_before = uncaught();
+        in_flight.thrown_at = s ? monotonic_now() : 0;
+        in_flight.active = true;
+    }
+}
+
+namespace unwind_costs {
+    inline void enable(bool on) noexcept {
+        detail::unwind_costs_on.store(on, std::memory_order_relaxed);
+    }
+
+    // The catch probe: call first thing in a handler for injected failures
+    inline void caught() noexcept {
+        if (detail::in_flight.active) detail::end_unwind(true);
+    }
+
+    // Writes one block per throw site, most throws first, e.g. to stdout
+    inline void report(std::FILE* out) {
+        site_costs* order[max_sites];
+        int n = 0;
+        for (auto& s : detail::unwind_sites)
+            if (s.site.load(std::memory_order_acquire) && s.throws.load(std::memory_order_relaxed))
+                order[n++] = &s;
+        for (int i = 1; i < n; ++i)         // insertion sort, nothing to allocate
+            for (int j = i; j > 0 && order[j]->throws.load() > order[j - 1]->throws.load(); --j)
+                std::swap(order[j], order[j - 1]);
+
+        std::fprintf(out, "Unwind costs of injected failures, by throw site:\n");
+        for (int i = 0; i < n; ++i) {
+            site_costs& s = *order[i];
+            std::uint64_t ended = s.probed.load() + s.unprobed.load();
+            std::fprintf(out, "  %p: %llu thrown, %llu caught at a probe, %llu elsewhere, %.2f allocations per unwind\n",
+                s.site.load(), (unsigned long long)s.throws.load(), (unsigned long long)s.probed.load(),
+                (unsigned long long)s.unprobed.load(), ended ? double(s.allocations.load()) / ended : 0.);
+            for (int b = 0; b < buckets; ++b)
+                if (std::uint64_t c = s.latency[b].load())
+                    std::fprintf(out, "      %10llu - %10llu ns  %llu\n",
+                        1ull << b, (2ull << b) - 1, (unsigned long long)c);
+        }
+        if (std::uint64_t lost = detail::unwind_overflow.load())
+            std::fprintf(out, "  (%llu throws from further sites not itemized)\n", (unsigned long long)lost);
+    }
+
+    inline void reset() noexcept {
+        for (auto& s : detail::unwind_sites) {
+            s.throws.store(0), s.probed.store(0), s.unprobed.store(0), s.allocations.store(0);
+            for (auto& b : s.latency) b.store(0);
+        }
+        detail::unwind_overflow.store(0);
+    }
+}
+
+
+//----------------------------------------------------------------------------
+//
+//  unwind_allocations: Find code that allocates while unwinding from bad_alloc.
+//
+//	Recovering from an allocation failure should not need to allocate, but
+//  destructors and other cleanup run during unwinding often do. The
+//  replacement operator new counts, per allocation site, every allocation
+//  made on a thread while a failure babb injected is still in flight there
+//  (between the throw and the catch handler, by std::uncaught_exceptions).
+//  This is always on: outside such windows it costs one thread-local branch.
+//
+//  fail(true) also fails those allocations (unless injection is paused), to
+//  check that the cleanup code copes; an exception leaving a destructor
+//  during unwinding terminates the program, which is exactly the kind of bug
+//  this is meant to find.
+//
+//----------------------------------------------------------------------------
+
+namespace unwind_allocations {
+    const int max_sites = 256;
+
+    struct site_count {
+        std::atomic<const void*> site{nullptr};
+        std::atomic<std::uint64_t> count{0};
+    };
+}
+
+namespace detail {
+    extern std::atomic<bool> fail_while_unwinding;
+    extern unwind_allocations::site_count unwinding_sites[unwind_allocations::max_sites];
+    extern std::atomic<std::uint64_t> unwinding_total;
+
+    // Called by the replacement operator new while in_flight.active; returns
+    // true if this allocation should fail
+    inline bool allocating_while_in_flight(const void* site) noexcept {
+        if (uncaught() <= in_flight.uncaught_before) {
+            end_unwind(false);      // caught without a probe (see unwind_costs)
+            return false;
+        }
+        ++in_flight.allocations;
+        unwinding_total.fetch_add(1, std::memory_order_relaxed);
+        if (unwind_allocations::site_count* s = site_slot(unwinding_sites, site))
+            s->count.fetch_add(1, std::memory_order_relaxed);
+        return fail_while_unwinding.load(std::memory_order_relaxed);
+    }
+}
+
+namespace unwind_allocations {
+    inline void fail(bool on) noexcept {
+        detail::fail_while_unwinding.store(on, std::memory_order_relaxed);
+    }
+
+    inline std::uint64_t total() noexcept {
+        return detail::unwinding_total.load(std::memory_order_relaxed);
+    }
+
+    // Writes the count per allocation site, most first
+    inline void report(std::FILE* out) {
+        site_count* order[max_sites];
+        int n = 0;
+        for (auto& s : detail::unwinding_sites)
+            if (s.site.load(std::memory_order_acquire) && s.count.load(std::memory_order_relaxed))
+                order[n++] = &s;
+        for (int i = 1; i < n; ++i)
+            for (int j = i; j > 0 && order[j]->count.load() > order[j - 1]->count.load(); --j)
+                std::swap(order[j], order[j - 1]);
+
+        std::fprintf(out, "Allocations while unwinding from injected failures: %llu\n", (unsigned long long)total());
+        for (int i = 0; i < n; ++i)
+            std::fprintf(out, "  %p: %llu\n", order[i]->site.load(), (unsigned long long)order[i]->count.load());
+    }
+
+    inline void reset() noexcept {
+        for (auto& s : detail::unwinding_sites) s.count.store(0);
+        detail::unwinding_total.store(0);
+    }
+}
+
+
+//----------------------------------------------------------------------------
+//  Injection context: the complete injection state of one logical thread of
+//  execution. Each OS thread owns one, and an executor can create one per task
+//  and install it on whichever thread happens to run the task (see below).
+//----------------------------------------------------------------------------
+
+class context : public state {
     class prng {
         // minstd_rand is sufficient and uses 1 word of storage
         // mt19937_64 is generally better but is overkill here, it uses 600+
@@ -116,17 +1067,116 @@ class this_thread_ : public state {
         using rtype = decltype(r)::result_type;
     public:
         prng() noexcept : r((rtype)reinterpret_cast<std::size_t>(this)) { }
+        prng(const prng&) = delete;
+        void operator=(const prng&) = delete;
 
+        // note: rtype may be wider than the generator's range, so use r.max()
         double operator()() noexcept
-            { return 1.*r() / std::numeric_limits<rtype>::max(); }
+            { return 1.*r() / decltype(r)::max(); }
+    };
+
+    // Whether each of the next 64 checks starts a new run, decided in one go
+    // so that a check costs a shift and a test instead of a random draw.
+    // Starts are a Bernoulli process, so rather than drawing each bit the
+    // refill draws the geometric gaps between set bits: at usual rates most
+    // words have no bit set and cost one subtraction. The gap being drawn is
+    // dropped, and redrawn for the new rate, whenever trigger changes. OOM
+    // events and free-driven runs start from the same bits.
+    class decision_bits {
+        static constexpr std::uint64_t far = std::uint64_t(1) << 62;   // never, in practice
+
+        std::uint64_t bits = 0;
+        int left = 0;
+        double log_miss = 0.;           // log(1 - trigger)
+        std::uint64_t next = far;       // checks from the end of bits to the next start
+
+        std::uint64_t gap(prng& random) noexcept {
+            if (log_miss == 0.) return far;
+            double g = std::log(random()) / log_miss;
+            if (g >= double(far)) return far;
+            return std::uint64_t(g);
+        }
+
+        void refill(prng& random) noexcept {
+            left = 64;
+            bits = 0;
+            while (next < 64) {
+                bits |= std::uint64_t(1) << next;
+                next += 1 + gap(random);
+            }
+            next -= 64;
+        }
+
+    public:
+        void retarget(double trigger, prng& random) noexcept {
+            double l = trigger >= 1. ? -std::numeric_limits<double>::infinity() : std::log1p(-trigger);
+            if (l == log_miss) return;
+            log_miss = l;
+            left = 0;
+            next = gap(random);
+        }
+
+        bool next_starts_run(prng& random) noexcept {
+            if (left == 0) refill(random);
+            --left;
+            bool start = bits & 1;
+            bits >>= 1;
+            return start;
+        }
     };
 
     prng random;
-    int run_in_progress = 0;
+    decision_bits decisions;
+    run_length_policy run;
+    int delay_left = 0;             // allocations still to delay in the current burst
+    std::uint64_t recover_at = 0;   // this thread's freed total that ends the current run
+
+    std::uint64_t seen_oom_epoch = 0;   // events up to this one are known to be over
+
+    bool oom_event_failure() noexcept {
+        std::uint64_t epoch = detail::oom_epoch.load(std::memory_order_relaxed);
+        if (epoch != seen_oom_epoch) {
+            std::atomic_thread_fence(std::memory_order_acquire);   // pairs with raise_oom_event
+            if (detail::monotonic_now() < detail::oom_end.load(std::memory_order_relaxed)) return true;
+            seen_oom_epoch = epoch;
+        }
+        if (!decisions.next_starts_run(random)) return false;
+        raise_oom_event(std::chrono::nanoseconds(oom_window));
+        return true;
+    }
+
+    bool free_driven_failure() noexcept {
+        if (recover_process_wide) {
+            std::uint64_t target = detail::recovery_target.load(std::memory_order_relaxed);
+            if (target) {
+                if (detail::freed_everywhere.load(std::memory_order_relaxed) < target) return true;
+                detail::recovery_target.compare_exchange_strong(target, 0, std::memory_order_relaxed);
+            }
+            if (!decisions.next_starts_run(random)) return false;
+            std::uint64_t none = 0;
+            detail::recovery_target.compare_exchange_strong(none,
+                detail::freed_everywhere.load(std::memory_order_relaxed) + recover_after, std::memory_order_relaxed);
+            return true;
+        }
+
+        if (recover_at) {
+            if (detail::freed_on_this_thread() < recover_at) return true;
+            recover_at = 0;
+        }
+        if (!decisions.next_starts_run(random)) return false;
+        recover_at = detail::freed_on_this_thread() + recover_after;
+        return true;
+    }
 
 public:
-    this_thread_() : state(shared) { }
-    
+    // A new context takes only the profile; its random sequence, decisions
+    // and any run in progress are its own. Copying one would make two
+    // contexts inject in lockstep, so contexts are not copyable.
+    context() : state(shared) { }
+    explicit context(const state& initial) : state(initial) { }
+    context(const context&) = delete;
+    void operator=(const context&) = delete;
+
 
     //----------------------------------------------------------------------------
     //
@@ -134,29 +1184,113 @@ public:
     //
     //  Returns true if it's time to inject a failure in this thread.
     //
+    //  on_path:  the kind of allocation being attempted (see paths)
+    //
     //----------------------------------------------------------------------------
 
-    bool should_inject_random_failure() noexcept {
+    bool should_inject_random_failure(unsigned on_path = paths::heap) noexcept {
+        bool inject = decide(on_path);
+        if (BABB_PROBE_ENABLED(decide)) BABB_PROBE3(decide, inject, on_path, this);
+        return inject;
+    }
+
+    // Report a failure about to be injected to tracers (see BABB_PROBE2) and
+    // to the injection log (see babb_log.h)
+    void report_injection(std::size_t size, const void* site, unsigned on_path = paths::heap) noexcept {
+        if (BABB_PROBE_ENABLED(inject)) BABB_PROBE3(inject, size, site, this);
+        if (detail::injection_logger log = detail::log_injection.load(std::memory_order_relaxed))
+            log(size, on_path, site);
+    }
+
+private:
+    bool decide(unsigned on_path) noexcept {
         assert(invariant());
 
-        if (paused) return false;
+        if (paused || pause_depth > 0 || !(targets & on_path)) return false;
+
+        if (--until_refresh < 0) {
+            refresh_trigger();
+            decisions.retarget(trigger, random);
+        }
 
-        auto trigger_a_new_run =
-            [&]{ return random() < 1./once_per/(run_length/2.); };
+        if (oom_window) return oom_event_failure();
+        if (recover_after) return free_driven_failure();
 
-        if (run_in_progress == 0 && trigger_a_new_run()) {
-            run_in_progress = 1 + int(random()*(run_length-1));
-            assert(invariant() && run_in_progress > 0);
+        if (!run.running() && decisions.next_starts_run(random)) {
+            run.begin(run_length, random());
+            assert(invariant() && run.running());
         }
 
-        if (run_in_progress > 0) { 
-            --run_in_progress; 
+        if (run.running()) { 
+            run.step(); 
             return true;
         }
         else
             return false;        
     }
 
+public:
+
+
+    //----------------------------------------------------------------------------
+    //
+    //	delay_for(size)
+    //
+    //  Returns how long to delay an allocation of size bytes in this thread,
+    //  usually zero. Like a failure, a delay is never injected while paused.
+    //
+    //----------------------------------------------------------------------------
+
+    std::chrono::nanoseconds delay_for(std::size_t size) noexcept {
+        if (!delay_per || is_paused() || size < delay_min_size || size > delay_max_size)
+            return std::chrono::nanoseconds(0);
+
+        if (delay_left == 0) {
+            if (random() * delay_per * delay_burst >= 1.) return std::chrono::nanoseconds(0);
+            delay_left = delay_burst;
+        }
+        --delay_left;
+
+        double mean = double(delay_mean);
+        switch (delay_shape) {
+        case delays::uniform:       mean *= 2. * random(); break;
+        case delays::exponential:   mean *= -std::log(random()); break;   // random() is never 0
+        default:                    break;
+        }
+        return std::chrono::nanoseconds(detail::nanos(mean));
+    }
+
+
+    //----------------------------------------------------------------------------
+    //
+    //	inject_random_delay(size)
+    //
+    //  Put a call to this function at the start of each of your custom
+    //  allocation functions to have them slowed down too. The replacement
+    //  operator new calls it before deciding whether to fail.
+    //
+    //----------------------------------------------------------------------------
+
+    void inject_random_delay(std::size_t size = 0) noexcept {
+        if (!delay_per) return;
+        std::chrono::nanoseconds length = delay_for(size);
+        if (length.count() > 0) detail::stall(length.count(), delay_method);
+    }
+
+
+    //----------------------------------------------------------------------------
+    //
+    //	note_free()
+    //
+    //  Tell the run-length policy that memory was released on this thread. The
+    //  replacement operator delete calls this when the policy counts frees.
+    //
+    //----------------------------------------------------------------------------
+
+    void note_free(std::size_t bytes) noexcept {
+        run.freed(bytes);
+    }
+
 
     //----------------------------------------------------------------------------
     //
@@ -170,9 +1304,17 @@ public:
     //----------------------------------------------------------------------------
 
     template<class E = std::bad_alloc>
-    void inject_random_failure() {
-        if (should_inject_random_failure())
+    BABB_NOINLINE void inject_random_failure()
+        { inject_random_failure_at<E>(BABB_RETURN_ADDRESS()); }
+
+    // The same, for callers that captured their own call site
+    template<class E = std::bad_alloc>
+    void inject_random_failure_at(const void* site) {
+        if (should_inject_random_failure()) {
+            report_injection(0, site);
+            detail::begin_unwind(site);
             throw E();
+        }
         // NOTE: We don't have to take care here to ensure that this doesn't allocate
         // normal memory, because the implementation is already required to be robust
         // so that "throw bad_alloc()" works in low-memory situations. Typically that
@@ -181,8 +1323,189 @@ public:
         // the exception will also immediately fail. So it's up to implementations to
         // make this line work, and if they don't then that's useful data too.
     }
+
+
+    //----------------------------------------------------------------------------
+    //
+    //	Other ways to report an injected failure
+    //
+    //  inject_random_failure<E>(size):  throw E(size) if E can be constructed
+    //                                   from the requested size, else E()
+    //  inject_random_error():           return errc::not_enough_memory as an
+    //                                   error_code, or an empty one
+    //  inject_random_failure_with(f, size):
+    //                                   call f(size) and return true, e.g. to
+    //                                   set an expected-style result; else
+    //                                   return false
+    //
+    //  The non-throwing forms are noexcept (the last one if f is), so code that
+    //  reports failures by return value keeps no exception paths.
+    //
+    //  Each is never inlined, so that the call site it reports is the
+    //  caller's; the *_at forms take a site captured by the caller instead.
+    //
+    //----------------------------------------------------------------------------
+
+    template<class E = std::bad_alloc>
+    BABB_NOINLINE void inject_random_failure(std::size_t size)
+        { inject_random_failure_at<E>(size, BABB_RETURN_ADDRESS()); }
+
+    BABB_NOINLINE std::error_code inject_random_error() noexcept
+        { return inject_random_error_at(BABB_RETURN_ADDRESS()); }
+
+    template<class F>
+    BABB_NOINLINE bool inject_random_failure_with(F&& on_failure, std::size_t size = 0) noexcept(noexcept(on_failure(size)))
+        { return inject_random_failure_with_at(std::forward<F>(on_failure), size, BABB_RETURN_ADDRESS()); }
+
+    template<class E = std::bad_alloc>
+    void inject_random_failure_at(std::size_t size, const void* site) {
+        if (should_inject_random_failure()) {
+            report_injection(size, site);
+            detail::begin_unwind(site);
+            throw detail::make_failure<E>(size);
+        }
+    }
+
+    std::error_code inject_random_error_at(const void* site) noexcept {
+        if (!should_inject_random_failure()) return std::error_code();
+        report_injection(0, site);
+        return std::make_error_code(std::errc::not_enough_memory);
+    }
+
+    template<class F>
+    bool inject_random_failure_with_at(F&& on_failure, std::size_t size, const void* site) noexcept(noexcept(on_failure(size))) {
+        if (!should_inject_random_failure()) return false;
+        report_injection(size, site);
+        on_failure(size);
+        return true;
+    }
+};
+
+
+//----------------------------------------------------------------------------
+//  Per-thread state
+//
+//  this_thread forwards to the context currently installed on this thread,
+//  which is the thread's own context unless an executor has installed a task's.
+//----------------------------------------------------------------------------
+
+class this_thread_ {
+    // No constructor, so that this_thread is constant-initialized (see
+    // BABB_TLS); the thread's own context is constructed on first use
+    context* active;
+    bool has_own;
+    alignas(context) unsigned char own_storage[sizeof(context)];
+
+    context& own() noexcept {
+        if (!has_own) {
+            ::new (static_cast<void*>(own_storage)) context();
+            has_own = true;
+        }
+        return *reinterpret_cast<context*>(own_storage);
+    }
+
+    context& ctx() noexcept { return active ? *active : *(active = &own()); }
+
+public:
+    this_thread_() = default;
+    this_thread_(const this_thread_&) = delete;
+    void operator=(const this_thread_&) = delete;
+
+    // state_guard and anything else that takes a state& sees the active context
+    operator state&() noexcept { return ctx(); }
+    context& current() noexcept { return ctx(); }
+
+
+    //----------------------------------------------------------------------------
+    //
+    //	install: Make c the active context on this thread; returns the previous one.
+    //
+    //  This only swaps a pointer, so an executor can call it every time it
+    //  resumes a task. Passing nullptr reinstalls the thread's own context.
+    //
+    //----------------------------------------------------------------------------
+
+    context* install(context* c) noexcept {
+        context* previous = &ctx();
+        active = c ? c : &own();
+        return previous;
+    }
+
+    void set_failure_profile(int fail_once_per, int max_run_length) noexcept
+        { ctx().set_failure_profile(fail_once_per, max_run_length); }
+
+    void set_failure_schedule(const schedule& s) noexcept
+        { ctx().set_failure_schedule(s); }
+
+    void set_failure_targets(unsigned on_paths) noexcept
+        { ctx().set_failure_targets(on_paths); }
+
+    void set_recovery(std::uint64_t bytes, recovery scope = recovery::this_thread) noexcept
+        { ctx().set_recovery(bytes, scope); }
+
+    void set_oom_events(std::chrono::nanoseconds window) noexcept
+        { ctx().set_oom_events(window); }
+
+    void set_delay_profile(int delay_once_per, std::chrono::nanoseconds mean_delay, int burst_length = 1,
+                           delays::method how = delays::spin, delays::shape distribution = delays::fixed) noexcept
+        { ctx().set_delay_profile(delay_once_per, mean_delay, burst_length, how, distribution); }
+
+    void set_delay_sizes(std::size_t min_size,
+                         std::size_t max_size = std::numeric_limits<std::size_t>::max()) noexcept
+        { ctx().set_delay_sizes(min_size, max_size); }
+
+    void pause(bool on) noexcept
+        { ctx().pause(on); }
+
+    bool should_inject_random_failure(unsigned on_path = paths::heap) noexcept
+        { return ctx().should_inject_random_failure(on_path); }
+
+    void note_free(std::size_t bytes) noexcept
+        { ctx().note_free(bytes); }
+
+    std::chrono::nanoseconds delay_for(std::size_t size) noexcept
+        { return ctx().delay_for(size); }
+
+    void inject_random_delay(std::size_t size = 0) noexcept
+        { ctx().inject_random_delay(size); }
+
+    template<class E = std::bad_alloc>
+    BABB_NOINLINE void inject_random_failure()
+        { ctx().template inject_random_failure_at<E>(BABB_RETURN_ADDRESS()); }
+
+    template<class E = std::bad_alloc>
+    BABB_NOINLINE void inject_random_failure(std::size_t size)
+        { ctx().template inject_random_failure_at<E>(size, BABB_RETURN_ADDRESS()); }
+
+    BABB_NOINLINE std::error_code inject_random_error() noexcept
+        { return ctx().inject_random_error_at(BABB_RETURN_ADDRESS()); }
+
+    template<class F>
+    BABB_NOINLINE bool inject_random_failure_with(F&& on_failure, std::size_t size = 0) noexcept(noexcept(on_failure(size)))
+        { return ctx().inject_random_failure_with_at(std::forward<F>(on_failure), size, BABB_RETURN_ADDRESS()); }
+};
+static_assert(std::is_trivially_destructible<context>::value, "a thread's own context is never destroyed");
+
+extern BABB_TLS this_thread_ this_thread;
+
+
+//----------------------------------------------------------------------------
+//
+//	Helper RAII type to install a context for the current scope
+//
+//	Use this in an executor around each slice of a task's execution, so that
+//  the task's profile and pause settings follow it from thread to thread
+//  instead of leaking into whatever else runs on those threads.
+//
+//----------------------------------------------------------------------------
+class context_scope {
+    context* previous;
+public:
+    explicit context_scope(context& c) noexcept : previous(this_thread.install(&c)) { }
+    ~context_scope() noexcept { this_thread.install(previous); }
+    context_scope(const context_scope&) = delete;
+    void operator=(const context_scope&) = delete;
 };
-thread_local this_thread_ this_thread;
 
 }
 
@@ -0,0 +1,101 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+//----------------------------------------------------------------------------
+//
+//  The babb agent: what babb-run loads into a program (see babb_run.cpp)
+//
+//  Built as a shared object together with babb.cpp and babb_patch.cpp. It
+//  injects by GOT patching, so the program itself needs no babb code:
+//
+//  - launched by babb-run, the agent is in LD_PRELOAD and starts injecting
+//    as it is loaded, with the profile babb-run passes in the environment
+//    (BABB_RUN_FAIL_ONCE_PER, BABB_RUN_RUN_LENGTH, BABB_RUN_INCLUDE,
+//    BABB_RUN_EXCLUDE);
+//
+//  - attached by babb-run, the agent is dlopened inside the running program
+//    and babb-run then calls the babb_agent_* functions below there.
+//
+//----------------------------------------------------------------------------
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "babb.h"
+#include "babb_patch.h"
+
+namespace {
+
+// Apply a comma-separated list of file name prefixes as got::include/exclude rules
+void add_rules(const char* list, void (*add)(const char*))
+{
+	if (!list) return;
+	std::string rules = list;
+	for (std::size_t begin = 0, end; begin < rules.size(); begin = end + 1) {
+		end = rules.find(',', begin);
+		if (end == std::string::npos) end = rules.size();
+		if (end > begin) add(rules.substr(begin, end - begin).c_str());
+	}
+}
+
+}
+
+extern "C" __attribute__((visibility("default")))
+int babb_agent_start(int fail_once_per, int run_length)
+{
+	if (fail_once_per <= 0 || run_length <= 0) return 0;
+	babb::shared.set_failure_profile(fail_once_per, run_length);
+	babb::this_thread.set_failure_profile(fail_once_per, run_length);	// may predate the call
+	return babb::got::patch() ? 1 : 0;
+}
+
+extern "C" __attribute__((visibility("default")))
+int babb_agent_include(const char* rules)
+{
+	babb::pause_guard bookkeeping(babb::this_thread);
+	add_rules(rules, babb::got::include);
+	return 1;
+}
+
+extern "C" __attribute__((visibility("default")))
+int babb_agent_exclude(const char* rules)
+{
+	babb::pause_guard bookkeeping(babb::this_thread);
+	add_rules(rules, babb::got::exclude);
+	return 1;
+}
+
+extern "C" __attribute__((visibility("default")))
+int babb_agent_stop()
+{
+	babb::got::depatch();
+	return 1;
+}
+
+// Started by LD_PRELOAD: configure from the environment babb-run set up
+__attribute__((constructor))
+static void babb_agent_preloaded()
+{
+	const char* once_per = std::getenv("BABB_RUN_FAIL_ONCE_PER");
+	const char* run_length = std::getenv("BABB_RUN_RUN_LENGTH");
+	if (!once_per) return;
+	babb_agent_include(std::getenv("BABB_RUN_INCLUDE"));
+	babb_agent_exclude(std::getenv("BABB_RUN_EXCLUDE"));
+	babb_agent_start(std::atoi(once_per), run_length ? std::atoi(run_length) : 5);
+}
@@ -0,0 +1,194 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BABB_BABB_COROUTINE_H
+#define BABB_BABB_COROUTINE_H
+
+#include "babb.h"
+
+//----------------------------------------------------------------------------
+//
+//  C++20 coroutine support: a promise base that gives each coroutine its own
+//  babb::context and keeps it installed exactly while the coroutine body runs,
+//  on whichever thread resumes it. This header is a no-op before C++20.
+//
+//  Usage:
+//
+//      struct promise_type : babb::coro::promise_base {
+//          // ... get_return_object, return_void, unhandled_exception ...
+//      };
+//
+//  promise_base supplies initial_suspend (lazy start), final_suspend and
+//  await_transform. If your promise needs a different initial or final
+//  awaitable, wrap it: "return on_start(std::suspend_never{});" and
+//  "return on_finish(your_final_awaiter{});".
+//
+//----------------------------------------------------------------------------
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <type_traits>
+#include <utility>
+
+namespace babb {
+namespace coro {
+
+namespace detail {
+    template<class A>
+    decltype(auto) get_awaiter(A&& a) {
+        if constexpr (requires { std::forward<A>(a).operator co_await(); })
+            return std::forward<A>(a).operator co_await();
+        else if constexpr (requires { operator co_await(std::forward<A>(a)); })
+            return operator co_await(std::forward<A>(a));
+        else
+            return std::forward<A>(a);
+    }
+
+    // Awaiters obtained from lvalues are referred to, anything else is moved in
+    template<class A, class T = decltype(get_awaiter(std::declval<A>()))>
+    using awaiter_t = std::conditional_t<std::is_lvalue_reference_v<T>, T, std::remove_cvref_t<T>>;
+}
+
+class promise_base;
+template<class> class start_awaiter;
+template<class> class finish_awaiter;
+
+//----------------------------------------------------------------------------
+//  Wraps an awaiter so that the coroutine's context is uninstalled before it
+//  suspends and reinstalled when it resumes (possibly on another thread).
+//----------------------------------------------------------------------------
+template<class Awaiter>
+class context_awaiter {
+    Awaiter inner;
+    promise_base& promise;
+    bool swapped = false;
+
+public:
+    template<class A>
+    context_awaiter(A&& a, promise_base& p) : inner(detail::get_awaiter(std::forward<A>(a))), promise(p) { }
+
+    bool await_ready() { return inner.await_ready(); }
+
+    template<class P>
+    decltype(auto) await_suspend(std::coroutine_handle<P> h);
+
+    decltype(auto) await_resume();
+};
+
+//----------------------------------------------------------------------------
+//  Promise base
+//----------------------------------------------------------------------------
+class promise_base {
+    template<class> friend class context_awaiter;
+    template<class> friend class start_awaiter;
+    template<class> friend class finish_awaiter;
+
+    context* resumed_from = nullptr;    // what to reinstall when we next suspend
+
+public:
+    // Each coroutine starts from the settings active where it was created
+    context babb_context{static_cast<const state&>(this_thread.current())};
+
+    template<class A>
+    start_awaiter<detail::awaiter_t<A>> on_start(A&& a)
+        { return {std::forward<A>(a), *this}; }
+
+    template<class A>
+    finish_awaiter<detail::awaiter_t<A>> on_finish(A&& a)
+        { return {std::forward<A>(a), *this}; }
+
+    start_awaiter<std::suspend_always> initial_suspend();
+    finish_awaiter<std::suspend_always> final_suspend() noexcept;
+
+    template<class A>
+    context_awaiter<detail::awaiter_t<A>> await_transform(A&& a)
+        { return {std::forward<A>(a), *this}; }
+};
+
+template<class Awaiter>
+template<class P>
+decltype(auto) context_awaiter<Awaiter>::await_suspend(std::coroutine_handle<P> h) {
+    // Uninstall first: once inner.await_suspend runs, another thread may
+    // already be resuming (or destroying) this coroutine
+    this_thread.install(promise.resumed_from);
+    swapped = true;
+    return inner.await_suspend(h);
+}
+
+template<class Awaiter>
+decltype(auto) context_awaiter<Awaiter>::await_resume() {
+    if (swapped)
+        promise.resumed_from = this_thread.install(&promise.babb_context);
+    return inner.await_resume();
+}
+
+//----------------------------------------------------------------------------
+//  Initial suspend: the body always starts with the context installed
+//----------------------------------------------------------------------------
+template<class Awaiter>
+class start_awaiter {
+    Awaiter inner;
+    promise_base& promise;
+public:
+    template<class A>
+    start_awaiter(A&& a, promise_base& p) : inner(detail::get_awaiter(std::forward<A>(a))), promise(p) { }
+
+    bool await_ready() { return inner.await_ready(); }
+
+    template<class P>
+    decltype(auto) await_suspend(std::coroutine_handle<P> h) { return inner.await_suspend(h); }
+
+    decltype(auto) await_resume() {
+        promise.resumed_from = this_thread.install(&promise.babb_context);
+        return inner.await_resume();
+    }
+};
+
+//----------------------------------------------------------------------------
+//  Final suspend: the body has finished, give the thread its context back
+//----------------------------------------------------------------------------
+template<class Awaiter>
+class finish_awaiter {
+    Awaiter inner;
+public:
+    template<class A>
+    finish_awaiter(A&& a, promise_base& p) noexcept : inner(detail::get_awaiter(std::forward<A>(a))) {
+        this_thread.install(p.resumed_from);
+    }
+
+    bool await_ready() noexcept { return inner.await_ready(); }
+
+    template<class P>
+    decltype(auto) await_suspend(std::coroutine_handle<P> h) noexcept { return inner.await_suspend(h); }
+
+    decltype(auto) await_resume() noexcept { return inner.await_resume(); }
+};
+
+inline start_awaiter<std::suspend_always> promise_base::initial_suspend()
+    { return on_start(std::suspend_always{}); }
+
+inline finish_awaiter<std::suspend_always> promise_base::final_suspend() noexcept
+    { return on_finish(std::suspend_always{}); }
+
+}
+}
+
+#endif
+
+#endif
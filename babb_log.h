@@ -0,0 +1,477 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BABB_BABB_LOG_H
+#define BABB_BABB_LOG_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace babb {
+
+//----------------------------------------------------------------------------
+//
+//  Allocation trace recording (implemented in new_replacements.cpp)
+//
+//	trace::start(path) begins recording every allocation and deallocation that
+//  goes through the replacement operator new/delete, and every failure babb
+//  injects there, into a binary log file at path, and trace::stop() ends it.
+//  Each thread buffers its own events and writes them out in chunks, so
+//  recording takes no locks on the hot path. Threads flush their last
+//  partial chunk when they exit, and stop() writes out what every other
+//  thread has recorded so far. A free records the size the block was asked
+//  for when delete is sized or the block is mapped, and otherwise what
+//  malloc reports as its usable size, which can be a little larger.
+//
+//  clock_every:  read the clock once per this many events on a thread, and
+//                stamp the events in between with the last reading. Their
+//                order in the log stays exact, but their times can lag. 1
+//                reads it for every event, at up to tens of ns per event
+//                where the timestamp counter is slow (e.g. virtual machines)
+//
+//----------------------------------------------------------------------------
+
+namespace trace {
+    bool start(const char* path, unsigned clock_every = 16) noexcept;
+    void stop() noexcept;
+}
+
+
+//----------------------------------------------------------------------------
+//
+//  Injection event log (implemented in new_replacements.cpp)
+//
+//  injection_log::start(path) logs every failure that babb injects, from the
+//  replacement operator new and from inject_random_failure and its variants,
+//  until injection_log::stop(). The log uses the format below, with only
+//  tag_inject events, so babb_summary reads it. It is cheap enough to stay
+//  on for a whole load test. Each injecting thread appends to a preallocated
+//  ring of its own, without allocating, locking or making a system call
+//  (except once, to set up its ring). A background thread drains all rings
+//  every flush_interval and writes the batch with one write. If a thread
+//  fills its ring between passes, further events are dropped and counted.
+//
+//----------------------------------------------------------------------------
+
+namespace injection_log {
+    struct statistics {
+        std::uint64_t written;      // events written to the log
+        std::uint64_t dropped;      // events lost to full rings
+    };
+
+    bool start(const char* path, std::chrono::milliseconds flush_interval = std::chrono::milliseconds(100)) noexcept;
+    void stop() noexcept;
+    statistics stats() noexcept;
+}
+
+
+//----------------------------------------------------------------------------
+//
+//  Sampling heap profiler (implemented in new_replacements.cpp)
+//
+//  heap_profile::start(sample_every) samples allocations made through the
+//  replacement operator new, about one every sample_every bytes, and records
+//  the call stack of each sampled one; heap_profile::stop() stops sampling.
+//  Each thread counts down a random number of bytes, drawn so that sampling
+//  is unbiased by allocation size, and only the allocation that takes it
+//  below zero captures a stack, so an unsampled allocation costs one
+//  subtraction and one branch. Other threads pick up start() within about a
+//  megabyte of allocation.
+//
+//  heap_profile::write(path) writes the sampled live heap (blocks not freed
+//  yet) and the sampled allocations since start() in the legacy text heap
+//  profile format, which pprof reads: pprof -inuse_space shows the live
+//  heap and pprof -alloc_space what was allocated, and pprof -base of an
+//  earlier profile the allocation rate in between. A sampled block is given
+//  a header to record its stack in, and page alignment so operator delete
+//  can find it, which costs up to a page per sample. Aligned operator new
+//  is not sampled.
+//
+//----------------------------------------------------------------------------
+
+namespace heap_profile {
+    struct statistics {
+        std::uint64_t sampled;      // allocations sampled since start()
+        std::uint64_t dropped;      // samples lost because the stack table was full
+    };
+
+    bool start(std::size_t sample_every = std::size_t(512) << 10) noexcept;
+    void stop() noexcept;
+    bool write(const char* path) noexcept;
+    statistics stats() noexcept;
+}
+
+
+//----------------------------------------------------------------------------
+//
+//  Binary log format, version 2
+//
+//  A file header, followed by any number of chunks. Each chunk holds events
+//  from a single thread, and is decodable on its own: all deltas restart
+//  from the values in the chunk header. Header fields are little-endian
+//  whatever the host; events are sequences of bytes (see below).
+//
+//      file_header             32 bytes; header_bytes gives the offset of
+//                              the first chunk, so later versions can grow it
+//      chunk_header            24 bytes
+//      events                  payload_bytes bytes, "events" of them
+//      chunk_header ...        and so on to the end of the file
+//
+//  Chunks from different threads are interleaved in the order they filled
+//  up, so events are in time order within a chunk but not across chunks.
+//  ticks_per_second is only known once recording stops; it is 0 in a log
+//  whose writer did not shut down cleanly, and the log then ends with the
+//  last complete chunk.
+//
+//  Readers accept any version up to their own. A reader that meets a tag
+//  it does not know stops decoding that chunk and carries on with the next,
+//  so new event kinds can be added without breaking old tools.
+//
+//  History:
+//      1   tag_alloc, tag_free
+//      2   tag_inject
+//
+//----------------------------------------------------------------------------
+
+namespace binlog {
+
+    const char     magic[8] = { 'B', 'A', 'B', 'B', 'L', 'O', 'G', '\0' };
+    const uint32_t version  = 2;
+    const uint32_t chunk_magic = 0x4B4E4843;    // "CHNK"
+
+    struct file_header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t header_bytes;          // sizeof(file_header), to allow growth
+        uint64_t ticks_per_second;      // timestamp unit, 0 if unknown
+        uint64_t start_ticks;
+    };
+
+    struct chunk_header {
+        uint32_t magic;                 // chunk_magic
+        uint32_t payload_bytes;         // bytes of events after this header
+        uint32_t thread;                // small per-process thread number
+        uint32_t events;
+        uint64_t first_ticks;           // base for the first event's time delta
+    };
+
+    static_assert(sizeof(file_header) == 32 && sizeof(chunk_header) == 24, "log headers must have a fixed layout");
+
+    // Headers are stored little-endian. These convert a header between the
+    // file's byte order and the host's, which is the same either way round;
+    // they do nothing on a little-endian host.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    inline uint32_t little_endian(uint32_t v) noexcept { return __builtin_bswap32(v); }
+    inline uint64_t little_endian(uint64_t v) noexcept { return __builtin_bswap64(v); }
+#else
+    inline uint32_t little_endian(uint32_t v) noexcept { return v; }
+    inline uint64_t little_endian(uint64_t v) noexcept { return v; }
+#endif
+
+    inline void little_endian(file_header& h) noexcept {
+        h.version = little_endian(h.version);
+        h.header_bytes = little_endian(h.header_bytes);
+        h.ticks_per_second = little_endian(h.ticks_per_second);
+        h.start_ticks = little_endian(h.start_ticks);
+    }
+
+    inline void little_endian(chunk_header& h) noexcept {
+        h.magic = little_endian(h.magic);
+        h.payload_bytes = little_endian(h.payload_bytes);
+        h.thread = little_endian(h.thread);
+        h.events = little_endian(h.events);
+        h.first_ticks = little_endian(h.first_ticks);
+    }
+
+    // Event payloads begin with one of these tags, then the fields listed
+    enum event_tag : uint8_t {
+        tag_alloc = 1,      // dticks, dptr, size, log2(alignment), dsite
+        tag_free  = 2,      // dticks, dptr, size (0 if unknown)
+        tag_inject = 3,     // dticks, size, log2(alignment), path, dsite
+    };
+
+    //  Field encodings:
+    //      dticks  varint: ticks since the previous event in the chunk
+    //      dptr    zigzag varint: address minus the previous address in the chunk
+    //      dsite   zigzag varint: call site minus the previous site in the chunk
+    //      size    varint
+    //      path    one byte: the babb::paths bit the failure was injected on
+    //
+    //  An injected failure stands for an allocation that was never made, so
+    //  it has no address and does not move the dptr base.
+
+    inline uint8_t* put_varint(uint8_t* out, uint64_t v) noexcept {
+        while (v >= 0x80) {
+            *out++ = uint8_t(v) | 0x80;
+            v >>= 7;
+        }
+        *out++ = uint8_t(v);
+        return out;
+    }
+
+    inline uint8_t* put_signed(uint8_t* out, int64_t v) noexcept {
+        return put_varint(out, (uint64_t(v) << 1) ^ uint64_t(v >> 63));
+    }
+
+    // Returns nullptr on truncated input
+    inline const uint8_t* get_varint(const uint8_t* in, const uint8_t* end, uint64_t& v) noexcept {
+        v = 0;
+        for (int shift = 0; in != end && shift < 64; shift += 7) {
+            uint8_t b = *in++;
+            v |= uint64_t(b & 0x7F) << shift;
+            if (!(b & 0x80)) return in;
+        }
+        return nullptr;
+    }
+
+    inline const uint8_t* get_signed(const uint8_t* in, const uint8_t* end, int64_t& v) noexcept {
+        uint64_t u;
+        in = get_varint(in, end, u);
+        v = int64_t(u >> 1) ^ -int64_t(u & 1);
+        return in;
+    }
+
+    // A decoded event
+    struct event {
+        event_tag tag;
+        uint32_t  thread;
+        uint64_t  ticks;
+        uint64_t  ptr;          // 0 for tag_inject
+        uint64_t  size;
+        uint64_t  alignment;    // tag_alloc and tag_inject only
+        uint64_t  site;         // tag_alloc and tag_inject only
+        unsigned  path;         // tag_inject only
+    };
+
+    //------------------------------------------------------------------------
+    //  Decodes the events of one chunk in order
+    //------------------------------------------------------------------------
+    class chunk_reader {
+        const uint8_t* at;
+        const uint8_t* end;
+        uint32_t thread;
+        uint64_t ticks;
+        uint64_t ptr = 0;
+        uint64_t site = 0;
+
+    public:
+        chunk_reader(const chunk_header& h, const uint8_t* payload) noexcept
+            : at(payload), end(payload + h.payload_bytes), thread(h.thread), ticks(h.first_ticks) { }
+
+        // Returns false at the end of the chunk, on malformed input, or at
+        // an event this reader does not know; complete() tells them apart
+        bool next(event& e) noexcept {
+            if (!at || at == end) return false;
+            e.tag = event_tag(*at++);
+            e.thread = thread;
+            e.path = 0;
+            uint64_t dticks, align_log2 = 0;
+            int64_t dptr = 0, dsite = 0;
+            bool known = e.tag == tag_alloc || e.tag == tag_free || e.tag == tag_inject;
+            at = known ? get_varint(at, end, dticks) : nullptr;
+            if (at && e.tag != tag_inject) at = get_signed(at, end, dptr);
+            if (at) at = get_varint(at, end, e.size);
+            if (at && e.tag != tag_free) {
+                if (end - at < 1 + (e.tag == tag_inject)) at = nullptr;
+                else {
+                    align_log2 = *at++;
+                    if (e.tag == tag_inject) e.path = *at++;
+                    at = get_signed(at, end, dsite);
+                }
+            }
+            if (!at || align_log2 > 63) {
+                at = nullptr;
+                return false;
+            }
+            e.ticks = ticks += dticks;
+            e.ptr = e.tag == tag_inject ? 0 : ptr += uint64_t(dptr);
+            e.site = site += uint64_t(dsite);
+            e.alignment = uint64_t(1) << align_log2;
+            return true;
+        }
+
+        bool complete() const noexcept { return at == end; }
+    };
+
+    //------------------------------------------------------------------------
+    //  Streams the events of a whole log file, chunk by chunk, in file order
+    //
+    //  The file is mapped read-only and scanned front to back; pages already
+    //  decoded are handed back to the system as the scan goes, so memory use
+    //  stays flat however large the log. Where the file cannot be mapped
+    //  (Windows, or a log bigger than a 32-bit address space) it is read one
+    //  chunk at a time instead. Either way nothing is held beyond the
+    //  current chunk.
+    //
+    //      binlog::reader in("run.babblog");
+    //      binlog::event e;
+    //      while (in.next(e)) ...
+    //      if (in.damaged()) ...   // truncated or corrupt tail
+    //------------------------------------------------------------------------
+    class reader {
+        file_header fh;
+        bool valid = false;
+        bool broken = false;
+        uint64_t skipped = 0;
+
+        chunk_header ch{};
+        chunk_reader chunk{ch, nullptr};
+        uint64_t offset = 0;            // of the next chunk header
+
+        const uint8_t* map = nullptr;   // whole file, if mapped
+        uint64_t length = 0;
+        uint64_t released = 0;          // prefix of map already given back
+        FILE* file = nullptr;           // otherwise
+        std::vector<uint8_t> payload;
+
+        static const uint64_t release_bytes = uint64_t(16) << 20;
+
+        reader(const reader&) = delete;
+        void operator=(const reader&) = delete;
+
+        // Unmapped files are only ever read sequentially, so at is implied
+        bool read_at(uint64_t at, void* out, size_t bytes) {
+            if (map) {
+                if (at > length || length - at < bytes) return false;
+                memcpy(out, map + at, bytes);
+                return true;
+            }
+            return file && fread(out, 1, bytes, file) == bytes;
+        }
+
+        void release_behind() noexcept {
+        #if !defined(_WIN32)
+            // Clean file pages: dropping them costs nothing but a re-read
+            if (map && offset - released >= release_bytes) {
+                uint64_t upto = offset & ~(uint64_t(::sysconf(_SC_PAGESIZE)) - 1);
+                ::madvise(const_cast<uint8_t*>(map + released), size_t(upto - released), MADV_DONTNEED);
+                released = upto;
+            }
+        #endif
+        }
+
+    public:
+        explicit reader(const char* path) {
+        #if !defined(_WIN32)
+            int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return;
+            struct stat st;
+            if (::fstat(fd, &st) == 0 && st.st_size > 0 && uint64_t(st.st_size) <= SIZE_MAX) {
+                void* m = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (m != MAP_FAILED) {
+                    map = static_cast<const uint8_t*>(m);
+                    length = uint64_t(st.st_size);
+                    ::madvise(m, size_t(length), MADV_SEQUENTIAL);
+                }
+            }
+            ::close(fd);
+        #endif
+            if (!map && !(file = fopen(path, "rb"))) return;
+
+            valid = read_at(0, &fh, sizeof(fh));
+            little_endian(fh);
+            valid = valid
+                && memcmp(fh.magic, magic, sizeof(fh.magic)) == 0
+                && fh.version >= 1 && fh.version <= version
+                && fh.header_bytes >= sizeof(fh);
+            offset = fh.header_bytes;
+            if (valid && file)
+                valid = fseek(file, long(offset), SEEK_SET) == 0;
+            broken = !valid;
+        }
+
+        ~reader() {
+        #if !defined(_WIN32)
+            if (map) ::munmap(const_cast<uint8_t*>(map), size_t(length));
+        #endif
+            if (file) fclose(file);
+        }
+
+        // False if the file is missing or is not a babb log of a known version
+        bool ok() const noexcept { return valid; }
+        const file_header& header() const noexcept { return fh; }
+
+        // True once the scan stopped early at a truncated or corrupt chunk
+        bool damaged() const noexcept { return broken; }
+
+        // Chunks cut short because they held events this reader does not
+        // know (from a newer writer) or could not decode
+        uint64_t skipped_chunks() const noexcept { return skipped; }
+
+        // Moves to the next chunk; false at the end of the log (or where it
+        // stops making sense). The payload stays valid until the next call.
+        bool next_chunk(chunk_header& h, const uint8_t*& events) {
+            if (!valid || broken) return false;
+            if (!read_at(offset, &h, sizeof(h))) {
+                broken = map ? offset != length : !feof(file);
+                return false;
+            }
+            little_endian(h);
+            if (h.magic != chunk_magic) {
+                broken = true;
+                return false;
+            }
+            offset += sizeof(h);
+            if (map) {
+                if (length - offset < h.payload_bytes) {
+                    broken = true;
+                    return false;
+                }
+                events = map + offset;
+            }
+            else {
+                payload.resize(h.payload_bytes);
+                if (!read_at(offset, payload.data(), payload.size())) {
+                    broken = true;
+                    return false;
+                }
+                events = payload.data();
+            }
+            offset += h.payload_bytes;
+            release_behind();
+            return true;
+        }
+
+        // Next event in file order: chunk by chunk, each chunk in time order
+        bool next(event& e) {
+            while (!chunk.next(e)) {
+                if (!chunk.complete()) ++skipped;
+                const uint8_t* events = nullptr;
+                if (!next_chunk(ch, events)) return false;
+                chunk = chunk_reader(ch, events);
+            }
+            return true;
+        }
+    };
+
+}
+
+}
+
+#endif
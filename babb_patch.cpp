@@ -0,0 +1,689 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "babb.h"
+#include "babb_patch.h"
+
+//----------------------------------------------------------------------------
+//
+//  Run-time GOT patching (see babb_patch.h)
+//
+//  Every call from an ELF object to a function in another object goes
+//  through a slot in the caller's global offset table, which the dynamic
+//  loader fills in with the callee's address. Rewriting that slot redirects
+//  the call, so patch() walks all loaded objects, finds the relocations
+//  (JUMP_SLOT for PLT calls, GLOB_DAT for -fno-plt calls and address
+//  loads) that name one of the hooked functions, and stores the address of
+//  the injecting wrapper there, remembering what it overwrote. depatch()
+//  puts the remembered values back. The slots of each object are found
+//  once, when it is first seen, and kept in a module table that follows
+//  dlopen and dlclose.
+//
+//----------------------------------------------------------------------------
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__) || defined(__arm__))
+#define BABB_GOT_PATCHING
+#endif
+
+#ifdef BABB_GOT_PATCHING
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace got_detail {
+
+	//------------------------------------------------------------------------
+	//  The hooked functions, by mangled name, and their originals as found
+	//  by the dynamic loader's global lookup when patch() first runs
+	//------------------------------------------------------------------------
+
+#if SIZE_MAX == UINT64_MAX
+#define BABB_MANGLED_SIZE_T "m"
+#else
+#define BABB_MANGLED_SIZE_T "j"
+#endif
+
+	enum hook_id {
+		h_malloc, h_calloc, h_realloc, h_free,
+		h_new, h_new_array, h_new_nothrow, h_new_array_nothrow,
+		h_new_aligned, h_new_array_aligned,
+		h_delete, h_delete_array, h_delete_sized, h_delete_array_sized,
+		h_dlopen, h_dlmopen, h_dlclose,
+		hook_count
+	};
+
+	const char* const hook_names[hook_count] = {
+		"malloc", "calloc", "realloc", "free",
+		"_Znw" BABB_MANGLED_SIZE_T, "_Zna" BABB_MANGLED_SIZE_T,
+		"_Znw" BABB_MANGLED_SIZE_T "RKSt9nothrow_t", "_Zna" BABB_MANGLED_SIZE_T "RKSt9nothrow_t",
+		"_Znw" BABB_MANGLED_SIZE_T "St11align_val_t", "_Zna" BABB_MANGLED_SIZE_T "St11align_val_t",
+		"_ZdlPv", "_ZdaPv", "_ZdlPv" BABB_MANGLED_SIZE_T, "_ZdaPv" BABB_MANGLED_SIZE_T,
+		"dlopen", "dlmopen", "dlclose",
+	};
+
+	void* originals[hook_count];
+
+	template<class F>
+	F original(hook_id h) { return reinterpret_cast<F>(originals[h]); }
+
+	//------------------------------------------------------------------------
+	//  The injecting wrappers. They are only reachable through patched GOT
+	//  slots, so the return address is the caller's call site. align_val_t
+	//  is passed like the size_t it wraps, so the aligned forms need no C++17.
+	//------------------------------------------------------------------------
+
+	bool inject_new(const void* site)
+	{
+		if (babb::detail::in_flight.active && babb::detail::allocating_while_in_flight(site)
+			&& !babb::this_thread.current().is_paused())
+			return true;
+		if (babb::this_thread.should_inject_random_failure()) {
+			babb::detail::begin_unwind(site);
+			return true;
+		}
+		return false;
+	}
+
+	// Sizing a block is a lookup in malloc's own metadata, so a free is only
+	// sized when something counts it: the run-length policy, this thread's
+	// free-driven recovery, or a process-wide one in progress
+	void note_free(void* p)
+	{
+		if (!p) return;
+		if (!babb::run_length_policy::counts_frees && !babb::this_thread.current().recovers_on_frees()
+			&& !babb::detail::recovery_target.load(std::memory_order_relaxed))
+			return;
+		std::size_t size = ::malloc_usable_size(p);
+		babb::released(size);
+		if (babb::run_length_policy::counts_frees) babb::this_thread.note_free(size);
+	}
+
+	void* malloc(std::size_t size)
+	{
+		if (babb::this_thread.should_inject_random_failure()) { errno = ENOMEM; return nullptr; }
+		return original<void*(*)(std::size_t)>(h_malloc)(size);
+	}
+
+	void* calloc(std::size_t n, std::size_t size)
+	{
+		if (babb::this_thread.should_inject_random_failure()) { errno = ENOMEM; return nullptr; }
+		return original<void*(*)(std::size_t, std::size_t)>(h_calloc)(n, size);
+	}
+
+	void* realloc(void* p, std::size_t size)
+	{
+		// A failed realloc leaves the block alone, so there is nothing to undo
+		if (size && babb::this_thread.should_inject_random_failure()) { errno = ENOMEM; return nullptr; }
+		return original<void*(*)(void*, std::size_t)>(h_realloc)(p, size);
+	}
+
+	void free(void* p)
+	{
+		note_free(p);
+		original<void(*)(void*)>(h_free)(p);
+	}
+
+	BABB_NOINLINE void* new_(std::size_t size)
+	{
+		if (inject_new(BABB_RETURN_ADDRESS())) throw std::bad_alloc();
+		return original<void*(*)(std::size_t)>(h_new)(size);
+	}
+
+	BABB_NOINLINE void* new_array(std::size_t size)
+	{
+		if (inject_new(BABB_RETURN_ADDRESS())) throw std::bad_alloc();
+		return original<void*(*)(std::size_t)>(h_new_array)(size);
+	}
+
+	void* new_nothrow(std::size_t size, const std::nothrow_t& nt) noexcept
+	{
+		if (babb::this_thread.should_inject_random_failure()) return nullptr;
+		return original<void*(*)(std::size_t, const std::nothrow_t&)>(h_new_nothrow)(size, nt);
+	}
+
+	void* new_array_nothrow(std::size_t size, const std::nothrow_t& nt) noexcept
+	{
+		if (babb::this_thread.should_inject_random_failure()) return nullptr;
+		return original<void*(*)(std::size_t, const std::nothrow_t&)>(h_new_array_nothrow)(size, nt);
+	}
+
+	BABB_NOINLINE void* new_aligned(std::size_t size, std::size_t alignment)
+	{
+		if (inject_new(BABB_RETURN_ADDRESS())) throw std::bad_alloc();
+		return original<void*(*)(std::size_t, std::size_t)>(h_new_aligned)(size, alignment);
+	}
+
+	BABB_NOINLINE void* new_array_aligned(std::size_t size, std::size_t alignment)
+	{
+		if (inject_new(BABB_RETURN_ADDRESS())) throw std::bad_alloc();
+		return original<void*(*)(std::size_t, std::size_t)>(h_new_array_aligned)(size, alignment);
+	}
+
+	void delete_(void* p) noexcept
+	{
+		note_free(p);
+		original<void(*)(void*)>(h_delete)(p);
+	}
+
+	void delete_array(void* p) noexcept
+	{
+		note_free(p);
+		original<void(*)(void*)>(h_delete_array)(p);
+	}
+
+	void delete_sized(void* p, std::size_t size) noexcept
+	{
+		note_free(p);
+		original<void(*)(void*, std::size_t)>(h_delete_sized)(p, size);
+	}
+
+	void delete_array_sized(void* p, std::size_t size) noexcept
+	{
+		note_free(p);
+		original<void(*)(void*, std::size_t)>(h_delete_array_sized)(p, size);
+	}
+
+	// Objects loaded and unloaded while patched (see below)
+	void* dlopen(const char* file, int mode);
+	void* dlmopen(Lmid_t namespace_id, const char* file, int mode);
+	int dlclose(void* handle);
+
+	void* const wrappers[hook_count] = {
+		reinterpret_cast<void*>(&malloc), reinterpret_cast<void*>(&calloc),
+		reinterpret_cast<void*>(&realloc), reinterpret_cast<void*>(&free),
+		reinterpret_cast<void*>(&new_), reinterpret_cast<void*>(&new_array),
+		reinterpret_cast<void*>(&new_nothrow), reinterpret_cast<void*>(&new_array_nothrow),
+		reinterpret_cast<void*>(&new_aligned), reinterpret_cast<void*>(&new_array_aligned),
+		reinterpret_cast<void*>(&delete_), reinterpret_cast<void*>(&delete_array),
+		reinterpret_cast<void*>(&delete_sized), reinterpret_cast<void*>(&delete_array_sized),
+		reinterpret_cast<void*>(&dlopen), reinterpret_cast<void*>(&dlmopen),
+		reinterpret_cast<void*>(&dlclose),
+	};
+
+	//------------------------------------------------------------------------
+	//  Which objects are patched: never those that implement the allocator
+	//  (or the loader); of the rest, those matching an include rule if there
+	//  are any, and not matching an exclude rule. Rules match the start of
+	//  the file name, without the directory.
+	//------------------------------------------------------------------------
+
+	const char* const system_objects[] = {
+		"linux-vdso.so", "linux-gate.so", "ld-linux", "ld64.so",
+		"libc.so", "libm.so", "libdl.so", "libpthread.so", "librt.so",
+		"libstdc++.so", "libc++.so", "libc++abi.so", "libgcc_s.so",
+	};
+
+	std::vector<std::string> included, excluded;
+
+	const char* file_name(const char* path)
+	{
+		const char* base = std::strrchr(path, '/');
+		return base ? base + 1 : path;
+	}
+
+	bool starts_with(const char* name, const std::string& prefix)
+	{
+		return std::strncmp(name, prefix.c_str(), prefix.size()) == 0;
+	}
+
+	bool is_system_object(const char* path)
+	{
+		const char* name = file_name(path);
+		for (const char* prefix : system_objects)
+			if (std::strncmp(name, prefix, std::strlen(prefix)) == 0)
+				return true;
+		return false;
+	}
+
+	bool selected(const std::string& path)
+	{
+		const char* name = file_name(path.c_str());
+		for (auto& rule : excluded)
+			if (starts_with(name, rule)) return false;
+		if (included.empty()) return true;
+		for (auto& rule : included)
+			if (starts_with(name, rule)) return true;
+		return false;
+	}
+
+	//------------------------------------------------------------------------
+	//  The module table: every loaded object that could be patched, with its
+	//  hooked GOT slots found when the object is first seen (see same_object
+	//  for when it is looked at again). Patching and depatching then only
+	//  write slots, and loading or unloading an object only adds or drops
+	//  its own entry.
+	//------------------------------------------------------------------------
+
+	struct slot {
+		void** where;
+		int    hook;
+		bool   relro;		// on a page the loader made read-only after relocation
+		void*  previous;	// while patched
+	};
+
+	struct object {
+		ElfW(Addr)  base;	// with its program headers, unique while it is loaded
+		const void* phdr;
+		std::string path;
+		std::vector<slot> slots;
+		bool patched = false;
+		bool present = true;
+	};
+
+	std::mutex lock;
+	std::vector<object> objects;
+	bool is_patched = false;
+	unsigned long long seen_adds = ~0ull, seen_subs = ~0ull;
+
+	std::uintptr_t page_size()
+	{
+		static const std::uintptr_t page = std::uintptr_t(::sysconf(_SC_PAGESIZE));
+		return page;
+	}
+
+	// The protection of each mapping, from /proc/self/maps, read once per
+	// pass when a RELRO slot is first written
+	class protections {
+		struct region { std::uintptr_t begin, end; int prot; };
+		std::vector<region> regions;
+		bool loaded = false;
+
+		void load()
+		{
+			loaded = true;
+			int fd = ::open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+			if (fd < 0) return;
+			std::string text;
+			char chunk[4096];
+			ssize_t n;
+			try {
+				while ((n = ::read(fd, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR))
+					if (n > 0) text.append(chunk, std::size_t(n));
+				regions.reserve(text.size() / 64);
+			}
+			catch (const std::bad_alloc&) { text.clear(); }
+			::close(fd);
+
+			// begin-end rwxp offset dev inode path, in address order
+			for (const char* line = text.c_str(); *line; ) {
+				char* at;
+				region r;
+				r.begin = std::uintptr_t(std::strtoull(line, &at, 16));
+				r.end = std::uintptr_t(std::strtoull(at + 1, &at, 16));
+				r.prot = (at[1] == 'r' ? PROT_READ : 0) | (at[2] == 'w' ? PROT_WRITE : 0) | (at[3] == 'x' ? PROT_EXEC : 0);
+				try { regions.push_back(r); }
+				catch (const std::bad_alloc&) { regions.clear(); return; }
+				const char* next = std::strchr(line, '\n');
+				line = next ? next + 1 : line + std::strlen(line);
+			}
+		}
+
+	public:
+		// The protection of the page at address page, or -1 if not known
+		int of(std::uintptr_t page)
+		{
+			if (!loaded) load();
+			auto r = std::upper_bound(regions.begin(), regions.end(), page,
+				[](std::uintptr_t a, const region& r) { return a < r.end; });
+			return r != regions.end() && r->begin <= page ? r->prot : -1;
+		}
+	};
+
+	// Write one slot. The loader makes the RELRO pages read-only, which
+	// leaves a last page that the segment ends inside writable; a slot's page
+	// is made writable only if it is not, and then given back what it had.
+	void write_slot(void** where, void* value, bool relro, protections& pages)
+	{
+		std::uintptr_t first = std::uintptr_t(where) & ~(page_size() - 1);
+		int prot = relro ? pages.of(first) : -1;
+		if (relro && prot < 0) prot = PROT_READ;
+		bool unprotect = relro && !(prot & PROT_WRITE);
+		if (unprotect) ::mprotect(reinterpret_cast<void*>(first), page_size(), prot | PROT_WRITE);
+		__atomic_store_n(where, value, __ATOMIC_RELEASE);
+		if (unprotect) ::mprotect(reinterpret_cast<void*>(first), page_size(), prot);
+	}
+
+	void apply(object& o, protections& pages)
+	{
+		if (o.patched || !selected(o.path)) return;
+		for (auto& s : o.slots) {
+			s.previous = *s.where;
+			write_slot(s.where, wrappers[s.hook], s.relro, pages);
+		}
+		o.patched = true;
+	}
+
+	void restore(object& o, protections& pages)
+	{
+		if (!o.patched) return;
+		// Newest first, in case a slot was listed twice (REL and JMPREL)
+		for (auto s = o.slots.rbegin(); s != o.slots.rend(); ++s)
+			write_slot(s->where, s->previous, s->relro, pages);
+		o.patched = false;
+	}
+
+#if defined(__x86_64__)
+	bool is_got_relocation(unsigned type) { return type == R_X86_64_JUMP_SLOT || type == R_X86_64_GLOB_DAT; }
+#elif defined(__i386__)
+	bool is_got_relocation(unsigned type) { return type == R_386_JMP_SLOT || type == R_386_GLOB_DAT; }
+#elif defined(__aarch64__)
+	bool is_got_relocation(unsigned type) { return type == R_AARCH64_JUMP_SLOT || type == R_AARCH64_GLOB_DAT; }
+#else
+	bool is_got_relocation(unsigned type) { return type == R_ARM_JUMP_SLOT || type == R_ARM_GLOB_DAT; }
+#endif
+
+#if UINTPTR_MAX == UINT64_MAX
+	unsigned relocation_type(std::uint64_t info)   { return unsigned(ELF64_R_TYPE(info)); }
+	std::size_t relocation_symbol(std::uint64_t info) { return std::size_t(ELF64_R_SYM(info)); }
+#else
+	unsigned relocation_type(std::uint32_t info)   { return unsigned(ELF32_R_TYPE(info)); }
+	std::size_t relocation_symbol(std::uint32_t info) { return std::size_t(ELF32_R_SYM(info)); }
+#endif
+
+	struct object_tables {
+		ElfW(Addr) base;
+		const ElfW(Sym)* symbols = nullptr;
+		const char* strings = nullptr;
+		ElfW(Addr) relro_begin = 0, relro_end = 0;	// the pages the loader protects
+	};
+
+	template<class Rel>
+	void find_slots(object& o, const object_tables& t, const Rel* rel, std::size_t bytes)
+	{
+		for (const Rel* end = rel + bytes / sizeof(Rel); rel < end; ++rel) {
+			if (!is_got_relocation(relocation_type(rel->r_info))) continue;
+			const char* name = t.strings + t.symbols[relocation_symbol(rel->r_info)].st_name;
+			for (int h = 0; h < hook_count; ++h) {
+				if (!originals[h] || std::strcmp(name, hook_names[h]) != 0) continue;
+				void** where = reinterpret_cast<void**>(t.base + rel->r_offset);
+				ElfW(Addr) page = ElfW(Addr)(where) & ~ElfW(Addr)(page_size() - 1);
+				bool relro = page >= t.relro_begin && page < t.relro_end;
+				o.slots.push_back({ where, h, relro, nullptr });
+				break;
+			}
+		}
+	}
+
+	void find_slots(object& o, const dl_phdr_info* info)
+	{
+		object_tables t;
+		t.base = info->dlpi_addr;
+		const ElfW(Dyn)* dynamic = nullptr;
+		for (int i = 0; i < info->dlpi_phnum; ++i) {
+			const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+			if (ph.p_type == PT_DYNAMIC)
+				dynamic = reinterpret_cast<const ElfW(Dyn)*>(t.base + ph.p_vaddr);
+			else if (ph.p_type == PT_GNU_RELRO)
+				t.relro_begin = (t.base + ph.p_vaddr) & ~ElfW(Addr)(page_size() - 1),
+				t.relro_end = (t.base + ph.p_vaddr + ph.p_memsz) & ~ElfW(Addr)(page_size() - 1);
+		}
+		if (!dynamic) return;
+
+		// glibc relocates these in place on most targets, but not on all
+		auto address = [&](ElfW(Addr) a) { return a < t.base ? a + t.base : a; };
+		ElfW(Addr) jmprel = 0, rel = 0, rela = 0;
+		std::size_t jmprel_bytes = 0, rel_bytes = 0, rela_bytes = 0;
+		ElfW(Sxword) jmprel_kind = 0;
+		for (const ElfW(Dyn)* d = dynamic; d->d_tag != DT_NULL; ++d) {
+			switch (d->d_tag) {
+			case DT_SYMTAB:   t.symbols = reinterpret_cast<const ElfW(Sym)*>(address(d->d_un.d_ptr)); break;
+			case DT_STRTAB:   t.strings = reinterpret_cast<const char*>(address(d->d_un.d_ptr)); break;
+			case DT_JMPREL:   jmprel = address(d->d_un.d_ptr); break;
+			case DT_PLTRELSZ: jmprel_bytes = d->d_un.d_val; break;
+			case DT_PLTREL:   jmprel_kind = d->d_un.d_val; break;
+			case DT_REL:      rel = address(d->d_un.d_ptr); break;
+			case DT_RELSZ:    rel_bytes = d->d_un.d_val; break;
+			case DT_RELA:     rela = address(d->d_un.d_ptr); break;
+			case DT_RELASZ:   rela_bytes = d->d_un.d_val; break;
+			}
+		}
+		if (!t.symbols || !t.strings) return;
+
+		if (jmprel && jmprel_kind == DT_RELA) find_slots(o, t, reinterpret_cast<const ElfW(Rela)*>(jmprel), jmprel_bytes);
+		if (jmprel && jmprel_kind == DT_REL)  find_slots(o, t, reinterpret_cast<const ElfW(Rel)*>(jmprel), jmprel_bytes);
+		if (rela) find_slots(o, t, reinterpret_cast<const ElfW(Rela)*>(rela), rela_bytes);
+		if (rel)  find_slots(o, t, reinterpret_cast<const ElfW(Rel)*>(rel), rel_bytes);
+	}
+
+	// What the loader's counters showed since the last refresh
+	struct changes {
+		bool any = true;
+		bool reloads = true;	// both loads and unloads, so an address may be reused
+	};
+
+	// Whether entry o still describes the object loaded where it was. After
+	// an unload and a load the new object can have the old one's address and
+	// program headers, so then a patched entry must still find its wrappers
+	// in its slots, and an unpatched one is scanned again.
+	bool maps(const dl_phdr_info* info, const void* p)
+	{
+		for (int i = 0; i < info->dlpi_phnum; ++i) {
+			const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+			ElfW(Addr) begin = info->dlpi_addr + ph.p_vaddr;
+			if (ph.p_type == PT_LOAD && ElfW(Addr)(p) >= begin && ElfW(Addr)(p) + sizeof(void*) <= begin + ph.p_memsz)
+				return true;
+		}
+		return false;
+	}
+
+	bool same_object(const object& o, const dl_phdr_info* info, const changes& c)
+	{
+		if (!c.reloads) return true;
+		if (!o.patched) return false;
+		for (auto& s : o.slots)
+			if (!maps(info, s.where) || *s.where != wrappers[s.hook]) return false;
+		return true;
+	}
+
+	int visit_object(dl_phdr_info* info, std::size_t, void* data)
+	{
+		const changes& c = *static_cast<const changes*>(data);
+		for (auto& o : objects) {
+			if (!o.present && o.base == info->dlpi_addr && o.phdr == info->dlpi_phdr) {
+				if (same_object(o, info, c)) { o.present = true; return 0; }
+				if (!o.patched) { o.slots.clear(); find_slots(o, info); o.present = true; return 0; }
+				break;		// a reloaded object; its slots went with the old one
+			}
+		}
+		const char* path = info->dlpi_name ? info->dlpi_name : "";
+		if (is_system_object(path)) return 0;
+		object o;
+		o.base = info->dlpi_addr;
+		o.phdr = info->dlpi_phdr;
+		o.path = path;
+		if (o.path.empty()) {		// the program itself
+			char self[PATH_MAX];
+			ssize_t n = ::readlink("/proc/self/exe", self, sizeof self - 1);
+			if (n > 0) o.path.assign(self, std::size_t(n));
+		}
+		find_slots(o, info);
+		objects.push_back(std::move(o));
+		return 0;
+	}
+
+	int read_counters(dl_phdr_info* info, std::size_t size, void* data)
+	{
+		if (size < offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) return 1;
+		changes& c = *static_cast<changes*>(data);
+		c.any = info->dlpi_adds != seen_adds || info->dlpi_subs != seen_subs;
+		c.reloads = info->dlpi_adds != seen_adds && info->dlpi_subs != seen_subs;
+		seen_adds = info->dlpi_adds, seen_subs = info->dlpi_subs;
+		return 1;		// the counters are the same in every entry
+	}
+
+	// Bring the module table up to date with the loaded objects, if any were
+	// loaded or unloaded since last time. Unloaded objects are dropped without
+	// touching their slots, which are gone with them. Call with lock held.
+	void refresh()
+	{
+		changes c;
+		::dl_iterate_phdr(read_counters, &c);
+		if (!c.any) return;
+		for (auto& o : objects) o.present = false;
+		::dl_iterate_phdr(visit_object, &c);
+		objects.erase(std::remove_if(objects.begin(), objects.end(), [](const object& o) { return !o.present; }),
+			objects.end());
+	}
+
+	void update_after_loader_call()
+	{
+		std::lock_guard<std::mutex> hold(lock);
+		babb::pause_guard bookkeeping(babb::this_thread);
+		try {
+			refresh();
+			protections pages;
+			if (is_patched)
+				for (auto& o : objects) apply(o, pages);
+		}
+		catch (const std::bad_alloc&) { }
+	}
+
+	//------------------------------------------------------------------------
+	//  While patched, dlopen, dlmopen and dlclose also go through babb, so
+	//  late-loaded objects are patched as soon as they are loaded, and the
+	//  slots of unloaded ones are forgotten. glibc resolves $ORIGIN and
+	//  RUNPATH relative to the object that calls dlopen, which with these
+	//  wrappers in between is the one that contains babb_patch.cpp.
+	//------------------------------------------------------------------------
+
+	void* dlopen(const char* file, int mode)
+	{
+		void* handle = original<void*(*)(const char*, int)>(h_dlopen)(file, mode);
+		if (handle) update_after_loader_call();
+		return handle;
+	}
+
+	void* dlmopen(Lmid_t namespace_id, const char* file, int mode)
+	{
+		void* handle = original<void*(*)(Lmid_t, const char*, int)>(h_dlmopen)(namespace_id, file, mode);
+		if (handle) update_after_loader_call();
+		return handle;
+	}
+
+	int dlclose(void* handle)
+	{
+		int result = original<int(*)(void*)>(h_dlclose)(handle);
+		update_after_loader_call();
+		return result;
+	}
+
+}
+
+bool babb::got::patch() noexcept
+{
+	std::lock_guard<std::mutex> hold(got_detail::lock);
+	if (got_detail::is_patched) return true;
+	babb::pause_guard bookkeeping(babb::this_thread);	// dlsym and the module table allocate
+
+	for (int h = 0; h < got_detail::hook_count; ++h)
+		if (!got_detail::originals[h])
+			got_detail::originals[h] = ::dlsym(RTLD_DEFAULT, got_detail::hook_names[h]);
+	if (!got_detail::originals[got_detail::h_malloc] || !got_detail::originals[got_detail::h_free])
+		return false;
+
+	got_detail::is_patched = true;
+	try {
+		got_detail::refresh();
+		got_detail::protections pages;
+		for (auto& o : got_detail::objects) got_detail::apply(o, pages);
+	}
+	catch (const std::bad_alloc&) { }	// keep what was patched; depatch() undoes it
+	return true;
+}
+
+void babb::got::depatch() noexcept
+{
+	std::lock_guard<std::mutex> hold(got_detail::lock);
+	babb::pause_guard bookkeeping(babb::this_thread);	// reading the page protections allocates
+	got_detail::protections pages;
+	for (auto& o : got_detail::objects) got_detail::restore(o, pages);
+	got_detail::is_patched = false;
+}
+
+bool babb::got::patched() noexcept
+{
+	std::lock_guard<std::mutex> hold(got_detail::lock);
+	return got_detail::is_patched;
+}
+
+std::size_t babb::got::patched_slots() noexcept
+{
+	std::lock_guard<std::mutex> hold(got_detail::lock);
+	std::size_t n = 0;
+	for (auto& o : got_detail::objects)
+		if (o.patched) n += o.slots.size();
+	return n;
+}
+
+std::size_t babb::got::patched_objects() noexcept
+{
+	std::lock_guard<std::mutex> hold(got_detail::lock);
+	std::size_t n = 0;
+	for (auto& o : got_detail::objects)
+		n += o.patched;
+	return n;
+}
+
+void babb::got::include(const char* prefix)
+{
+	std::lock_guard<std::mutex> hold(got_detail::lock);
+	babb::pause_guard bookkeeping(babb::this_thread);
+	got_detail::included.push_back(prefix);
+}
+
+void babb::got::exclude(const char* prefix)
+{
+	std::lock_guard<std::mutex> hold(got_detail::lock);
+	babb::pause_guard bookkeeping(babb::this_thread);
+	got_detail::excluded.push_back(prefix);
+}
+
+void babb::got::clear_rules() noexcept
+{
+	std::lock_guard<std::mutex> hold(got_detail::lock);
+	got_detail::included.clear();
+	got_detail::excluded.clear();
+}
+
+#else
+
+bool babb::got::patch() noexcept { return false; }
+void babb::got::depatch() noexcept { }
+bool babb::got::patched() noexcept { return false; }
+std::size_t babb::got::patched_slots() noexcept { return 0; }
+std::size_t babb::got::patched_objects() noexcept { return 0; }
+void babb::got::include(const char*) { }
+void babb::got::exclude(const char*) { }
+void babb::got::clear_rules() noexcept { }
+
+#endif
@@ -0,0 +1,71 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+#ifndef BABB_BABB_PATCH_H
+#define BABB_BABB_PATCH_H
+
+#include <cstddef>
+
+namespace babb {
+
+//----------------------------------------------------------------------------
+//
+//  Switching injection on and off at run time (implemented in babb_patch.cpp)
+//
+//  An alternative to new_replacements.cpp for processes that should normally
+//  run untouched, such as long-running canaries. got::patch() rewrites the
+//  GOT entries of every loaded ELF object for malloc, calloc, realloc, free
+//  and the global operator new/delete, so that they call babb's injecting
+//  versions; got::depatch() writes the original entries back. While
+//  depatched the process runs on its own allocator with no babb code, not
+//  even a branch, on the allocation path.
+//
+//  The C library, the C++ runtime and the dynamic loader are left alone:
+//  they implement the allocator, and injecting into their internal calls
+//  would count each allocation twice. Calls made through function pointers
+//  taken before patch() are not redirected.
+//
+//  While patched, dlopen, dlmopen and dlclose are redirected as well, so
+//  objects loaded later (plugins) are patched as soon as they are loaded.
+//  To patch only some objects, call include() and exclude() before patch():
+//  each takes the start of a file name without its directory, such as
+//  "libplugin_" or "libfoo.so". If there are include rules only matching
+//  objects are patched, and objects matching an exclude rule never are.
+//  Rules take effect for objects not patched yet.
+//
+//  Link either babb_patch.cpp or new_replacements.cpp, not both. Only
+//  supported on Linux (x86, x86-64, ARM, AArch64); elsewhere patch() returns
+//  false and does nothing.
+//
+//----------------------------------------------------------------------------
+
+namespace got {
+    bool patch() noexcept;              // false if unsupported; patching twice is harmless
+    void depatch() noexcept;
+    bool patched() noexcept;
+    std::size_t patched_slots() noexcept;   // GOT entries currently redirected
+    std::size_t patched_objects() noexcept;
+
+    void include(const char* file_name_prefix);
+    void exclude(const char* file_name_prefix);
+    void clear_rules() noexcept;
+}
+
+}
+
+#endif
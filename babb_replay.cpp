@@ -0,0 +1,139 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+//----------------------------------------------------------------------------
+//
+//  babb_replay: re-execute a recorded allocation trace (see babb::trace)
+//
+//  Replays all allocations and frees of the trace, merged across threads in
+//  timestamp order, on a single thread and at full speed, against the
+//  replacement allocator in new_replacements.cpp with babb injection enabled
+//  (failures injected while recording are not replayed, babb injects anew).
+//  Blocks that fail to allocate are simply skipped when the trace later
+//  frees them.
+//
+//  Build together with babb.cpp and new_replacements.cpp (or link the babb
+//  library, see CMakeLists.txt), e.g.:
+//      g++ -O2 -std=c++17 babb_replay.cpp babb.cpp new_replacements.cpp -o babb_replay
+//
+//  Usage:
+//      babb_replay [--fail-once-per=N] [--run-length=N] [--no-inject] TRACE
+//
+//----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "babb.h"
+#include "babb_log.h"
+
+bool read_trace(const char* path, vector<babb::binlog::event>& events) {
+    babb::binlog::reader in(path);
+    babb::binlog::event e;
+    while (in.next(e))
+        if (e.tag != babb::binlog::tag_inject)     // recorded failures are not replayed
+            events.push_back(e);
+
+    // chunks are written as they fill up, so restore global time order
+    stable_sort(events.begin(), events.end(),
+        [](const babb::binlog::event& a, const babb::binlog::event& b) { return a.ticks < b.ticks; });
+    return in.ok() && !in.damaged();
+}
+
+struct live_block {
+    void* p;
+    size_t alignment;
+};
+
+void release(const live_block& b) {
+    if (b.alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+        ::operator delete(b.p, align_val_t(b.alignment));
+    else
+        ::operator delete(b.p);
+}
+
+int main(int argc, char* argv[]) {
+    babb::this_thread.pause(true);      // only the replayed allocations may fail
+
+    int fail_once_per = 10000, run_length = 5;
+    bool inject = true;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if      (arg.compare(0, 16, "--fail-once-per=") == 0) fail_once_per = atoi(argv[i] + 16);
+        else if (arg.compare(0, 13, "--run-length=") == 0)    run_length = atoi(argv[i] + 13);
+        else if (arg == "--no-inject")                        inject = false;
+        else if (!path && arg[0] != '-')                      path = argv[i];
+        else path = nullptr, i = argc;
+    }
+    if (!path || fail_once_per <= 0 || run_length <= 0) {
+        fprintf(stderr, "usage: %s [--fail-once-per=N] [--run-length=N] [--no-inject] TRACE\n", argv[0]);
+        return 1;
+    }
+
+    vector<babb::binlog::event> events;
+    if (!read_trace(path, events))
+        fprintf(stderr, "warning: %s is truncated or malformed, replaying what could be read\n", path);
+
+    unordered_map<uint64_t, live_block> live;
+    live.reserve(events.size() / 2 + 1);
+    long allocations = 0, failures = 0, frees = 0, unmatched_frees = 0;
+
+    babb::this_thread.set_failure_profile(fail_once_per, run_length);
+    babb::this_thread.pause(!inject);
+    auto start = chrono::steady_clock::now();
+    for (auto& e : events) {
+        if (e.tag == babb::binlog::tag_alloc) {
+            ++allocations;
+            live_block b = { nullptr, size_t(e.alignment) };
+            try {
+                b.p = b.alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__
+                    ? ::operator new(size_t(e.size), align_val_t(b.alignment))
+                    : ::operator new(size_t(e.size));
+            }
+            catch (const bad_alloc&) { ++failures; }
+            if (b.p) {
+                babb::pause_guard bookkeeping(babb::this_thread);
+                live[e.ptr] = b;
+            }
+        }
+        else if (e.tag == babb::binlog::tag_free) {
+            auto found = live.find(e.ptr);
+            if (found == live.end()) { ++unmatched_frees; continue; }
+            ++frees;
+            release(found->second);
+            live.erase(found);
+        }
+    }
+    auto stop = chrono::steady_clock::now();
+    babb::this_thread.pause(true);
+
+    for (auto& b : live) release(b.second);
+
+    double ns = chrono::duration<double, nano>(stop - start).count();
+    printf("%zu events replayed in %.3f s (%.1f ns/event)\n", events.size(), ns / 1e9, events.empty() ? 0. : ns / events.size());
+    printf("%ld allocations, %ld injected failures, %ld frees, %ld frees of blocks not allocated in the replay\n",
+        allocations, failures, frees, unmatched_frees);
+}
@@ -0,0 +1,309 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+//----------------------------------------------------------------------------
+//
+//  babb-run: inject failures into a program without rebuilding it (Linux)
+//
+//  Launches a program with the babb agent (babb_agent.cpp) preloaded, or
+//  attaches to a running process with ptrace, loads the agent into it and
+//  starts (or stops) injection there, so a warm process need not restart.
+//  Either way the agent injects by GOT patching (see babb_patch.h).
+//
+//  Attaching stops the process's main thread, makes it call dlopen and the
+//  agent's entry points as if from a signal handler, and then restores its
+//  registers and stack exactly. Its other threads keep running. It needs
+//  permission to ptrace the process (same user, and see the kernel's
+//  yama/ptrace_scope setting), and is only implemented for x86-64. If the
+//  main thread was stopped inside the allocator or the loader, the dlopen
+//  may deadlock; attach again if it does not return.
+//
+//  Build it and the agent with CMake, or e.g.:
+//      g++ -O2 -std=c++11 babb_run.cpp -ldl -o babb-run
+//      g++ -O2 -std=c++11 -shared -fPIC babb_agent.cpp babb.cpp babb_patch.cpp -ldl -o babb_agent.so
+//
+//  Usage:
+//      babb-run [OPTIONS] -- PROGRAM [ARGS...]     launch PROGRAM under babb
+//      babb-run [OPTIONS] --pid=PID                start injecting in PID
+//      babb-run --pid=PID --stop                   stop injecting in PID
+//  Options:
+//      --fail-once-per=N --run-length=N            the failure profile
+//      --include=PREFIX,... --exclude=PREFIX,...   which objects to patch
+//      --agent=PATH                                default: next to babb-run
+//
+//----------------------------------------------------------------------------
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct options {
+    int fail_once_per = 10000, run_length = 5;
+    string include, exclude, agent;
+    pid_t pid = 0;
+    bool stop = false;
+};
+
+string agent_next_to_this_program() {
+    char self[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof self - 1);
+    if (n <= 0) return "babb_agent.so";
+    string path(self, size_t(n));
+    return path.substr(0, path.rfind('/') + 1) + "babb_agent.so";
+}
+
+
+//----------------------------------------------------------------------------
+//  Launching: preload the agent and pass the configuration in the environment
+//----------------------------------------------------------------------------
+
+int launch(const options& o, char* argv[]) {
+    string preload = o.agent;
+    if (const char* existing = getenv("LD_PRELOAD"))
+        if (*existing) preload += string(":") + existing;
+    setenv("LD_PRELOAD", preload.c_str(), 1);
+    setenv("BABB_RUN_FAIL_ONCE_PER", to_string(o.fail_once_per).c_str(), 1);
+    setenv("BABB_RUN_RUN_LENGTH", to_string(o.run_length).c_str(), 1);
+    if (!o.include.empty()) setenv("BABB_RUN_INCLUDE", o.include.c_str(), 1);
+    if (!o.exclude.empty()) setenv("BABB_RUN_EXCLUDE", o.exclude.c_str(), 1);
+
+    execvp(argv[0], argv);
+    fprintf(stderr, "babb-run: cannot run %s: %s\n", argv[0], strerror(errno));
+    return 127;
+}
+
+
+//----------------------------------------------------------------------------
+//  Attaching: call functions inside the stopped process
+//----------------------------------------------------------------------------
+
+#if defined(__x86_64__)
+
+// Where the object that defines a function in this process is loaded in pid,
+// plus the function's offset in it. Both processes map the same file.
+uint64_t remote_address(pid_t pid, void* local) {
+    Dl_info info;
+    char real[PATH_MAX];
+    if (!local || !dladdr(local, &info) || !info.dli_fname || !realpath(info.dli_fname, real)) return 0;
+
+    ifstream maps("/proc/" + to_string(pid) + "/maps");
+    for (string line; getline(maps, line); ) {
+        istringstream fields(line);
+        string range, perms, offset, device, inode, path;
+        fields >> range >> perms >> offset >> device >> inode >> path;
+        if (path != real || strtoull(offset.c_str(), nullptr, 16) != 0) continue;
+        uint64_t base = strtoull(range.c_str(), nullptr, 16);
+        return base + (uint64_t(local) - uint64_t(info.dli_fbase));
+    }
+    return 0;
+}
+
+class tracee {
+    pid_t pid;
+    int mem = -1;
+    user_regs_struct saved;
+    bool attached = false;
+
+    // A scratch area below the stack pointer and its red zone, saved and restored
+    static constexpr size_t scratch_bytes = 4096;
+    uint64_t scratch = 0;
+    vector<char> scratch_saved;
+    size_t scratch_used = 16;   // the first 16 bytes hold the return address
+
+    bool wait_stop(int& signal) {
+        int status;
+        if (waitpid(pid, &status, __WALL) != pid || !WIFSTOPPED(status)) return false;
+        signal = WSTOPSIG(status);
+        return true;
+    }
+
+public:
+    explicit tracee(pid_t p) : pid(p) { }
+
+    bool attach() {
+        if (ptrace(PTRACE_ATTACH, pid, nullptr, nullptr) != 0) return false;
+        attached = true;
+        int signal;
+        while (wait_stop(signal) && signal != SIGSTOP)
+            ptrace(PTRACE_CONT, pid, nullptr, reinterpret_cast<void*>(intptr_t(signal)));
+        if (signal != SIGSTOP) return false;
+        if (ptrace(PTRACE_GETREGS, pid, nullptr, &saved) != 0) return false;
+        mem = open(("/proc/" + to_string(pid) + "/mem").c_str(), O_RDWR);
+        if (mem < 0) return false;
+        scratch = (saved.rsp - 128 - scratch_bytes) & ~uint64_t(15);
+        scratch_saved.resize(scratch_bytes);
+        return pread(mem, scratch_saved.data(), scratch_bytes, off_t(scratch)) == ssize_t(scratch_bytes);
+    }
+
+    ~tracee() {
+        if (!scratch_saved.empty() && mem >= 0)
+            (void) !pwrite(mem, scratch_saved.data(), scratch_bytes, off_t(scratch));
+        if (attached) {
+            ptrace(PTRACE_SETREGS, pid, nullptr, &saved);
+            ptrace(PTRACE_DETACH, pid, nullptr, nullptr);
+        }
+        if (mem >= 0) close(mem);
+    }
+
+    // Copy a string into the scratch area and return its address there
+    uint64_t put(const string& s) {
+        if (scratch_used + s.size() + 1 > scratch_bytes) return 0;
+        uint64_t at = scratch + scratch_used;
+        if (pwrite(mem, s.c_str(), s.size() + 1, off_t(at)) != ssize_t(s.size() + 1)) return 0;
+        scratch_used += (s.size() + 16) & ~size_t(15);
+        return at;
+    }
+
+    uint64_t read_word(uint64_t at) {
+        uint64_t word = 0;
+        return pread(mem, &word, sizeof word, off_t(at)) == ssize_t(sizeof word) ? word : 0;
+    }
+
+    // Call fn(a, b, c) on the stopped thread. It returns to address 0, and
+    // the resulting SIGSEGV stop hands control back with the result in rax.
+    bool call(uint64_t fn, uint64_t a, uint64_t b, uint64_t c, uint64_t& result) {
+        uint64_t return_slot = scratch + 8;     // rsp % 16 == 8 on entry, as after a call
+        uint64_t zero = 0;
+        if (!fn || pwrite(mem, &zero, sizeof zero, off_t(return_slot)) != ssize_t(sizeof zero)) return false;
+
+        user_regs_struct regs = saved;
+        regs.rip = fn, regs.rsp = return_slot;
+        regs.rdi = a, regs.rsi = b, regs.rdx = c;
+        regs.rax = 0;
+        regs.orig_rax = uint64_t(-1);           // do not restart an interrupted system call now
+        if (ptrace(PTRACE_SETREGS, pid, nullptr, &regs) != 0) return false;
+
+        int signal = 0;
+        for (;;) {
+            if (ptrace(PTRACE_CONT, pid, nullptr, reinterpret_cast<void*>(intptr_t(signal))) != 0) return false;
+            if (!wait_stop(signal)) return false;
+            if (signal == SIGSEGV) break;
+            if (signal == SIGSTOP) signal = 0;  // not passed on, as when attaching
+        }
+        if (ptrace(PTRACE_GETREGS, pid, nullptr, &regs) != 0 || regs.rip != 0) return false;
+        result = regs.rax;
+        return true;
+    }
+};
+
+int attach(const options& o) {
+    uint64_t dlopen_at = remote_address(o.pid, dlsym(RTLD_DEFAULT, "dlopen"));
+    uint64_t dlsym_at = remote_address(o.pid, dlsym(RTLD_DEFAULT, "dlsym"));
+    if (!dlopen_at || !dlsym_at) {
+        fprintf(stderr, "babb-run: cannot find dlopen in process %d\n", int(o.pid));
+        return 1;
+    }
+
+    tracee t(o.pid);
+    if (!t.attach()) {
+        fprintf(stderr, "babb-run: cannot attach to process %d: %s\n", int(o.pid), strerror(errno));
+        return 1;
+    }
+
+    auto fail = [&](const char* what) {
+        fprintf(stderr, "babb-run: %s in process %d\n", what, int(o.pid));
+        return 1;
+    };
+    uint64_t handle = 0, result = 0;
+    if (!t.call(dlopen_at, t.put(o.agent), RTLD_NOW, 0, handle) || !handle)
+        return fail("cannot load the agent");
+
+    auto agent_function = [&](const char* name) {
+        uint64_t at = 0;
+        return t.call(dlsym_at, handle, t.put(name), 0, at) ? at : 0;
+    };
+    if (o.stop) {
+        if (!t.call(agent_function("babb_agent_stop"), 0, 0, 0, result)) return fail("cannot stop injection");
+        printf("babb-run: stopped injecting in process %d\n", int(o.pid));
+        return 0;
+    }
+    if (!o.include.empty() && !t.call(agent_function("babb_agent_include"), t.put(o.include), 0, 0, result))
+        return fail("cannot set include rules");
+    if (!o.exclude.empty() && !t.call(agent_function("babb_agent_exclude"), t.put(o.exclude), 0, 0, result))
+        return fail("cannot set exclude rules");
+    if (!t.call(agent_function("babb_agent_start"), uint64_t(o.fail_once_per), uint64_t(o.run_length), 0, result)
+        || !int(result))
+        return fail("cannot start injection");
+    printf("babb-run: injecting in process %d, once per %d allocations, runs of %d\n",
+        int(o.pid), o.fail_once_per, o.run_length);
+    return 0;
+}
+
+#else
+
+int attach(const options&) {
+    fprintf(stderr, "babb-run: attaching is only implemented for x86-64\n");
+    return 1;
+}
+
+#endif
+
+
+int main(int argc, char* argv[]) {
+    options o;
+    int program = 0;
+    bool usage = false;
+    for (int i = 1; i < argc && !program; ++i) {
+        string arg = argv[i];
+        if      (arg.compare(0, 16, "--fail-once-per=") == 0) o.fail_once_per = atoi(argv[i] + 16);
+        else if (arg.compare(0, 13, "--run-length=") == 0)    o.run_length = atoi(argv[i] + 13);
+        else if (arg.compare(0, 10, "--include=") == 0)       o.include = argv[i] + 10;
+        else if (arg.compare(0, 10, "--exclude=") == 0)       o.exclude = argv[i] + 10;
+        else if (arg.compare(0, 8, "--agent=") == 0)          o.agent = argv[i] + 8;
+        else if (arg.compare(0, 6, "--pid=") == 0)            o.pid = pid_t(atoi(argv[i] + 6));
+        else if (arg == "--stop")                             o.stop = true;
+        else if (arg == "--" && i + 1 < argc)                 program = i + 1;
+        else usage = true;
+    }
+    if (usage || (o.pid > 0) == (program > 0) || (o.stop && !o.pid) || o.fail_once_per <= 0 || o.run_length <= 0) {
+        fprintf(stderr,
+            "usage: %s [OPTIONS] -- PROGRAM [ARGS...]\n"
+            "       %s [OPTIONS] --pid=PID\n"
+            "       %s --pid=PID --stop\n"
+            "options: --fail-once-per=N --run-length=N --include=PREFIX,... --exclude=PREFIX,... --agent=PATH\n",
+            argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    if (o.agent.empty()) o.agent = agent_next_to_this_program();
+    char real[PATH_MAX];
+    if (!realpath(o.agent.c_str(), real)) {     // the target resolves it from its own directory
+        fprintf(stderr, "babb-run: cannot find the agent %s\n", o.agent.c_str());
+        return 1;
+    }
+    o.agent = real;
+
+    return o.pid ? attach(o) : launch(o, argv + program);
+}
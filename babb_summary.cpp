@@ -0,0 +1,147 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+//----------------------------------------------------------------------------
+//
+//  babb_summary: per-thread and per-call-site statistics of a babb log
+//
+//  Streams the log once (see binlog::reader), so it runs in memory
+//  proportional to the number of threads and call sites, not to the size of
+//  the log. Sites are the return addresses recorded by operator new; map
+//  them to source with e.g. addr2line, allowing for where the executable
+//  was loaded in the recorded run.
+//
+//  Needs no babb runtime, so build it on its own, e.g.:
+//      g++ -O2 -std=c++11 babb_summary.cpp -o babb_summary
+//
+//  Usage:
+//      babb_summary [--top=N] LOG      (N sites, by injected failures; default 20)
+//
+//----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "babb.h"
+#include "babb_log.h"
+
+struct counts {
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+    uint64_t bytes = 0;                 // allocated
+    uint64_t injected = 0;
+    uint64_t injected_mapped = 0;       // of which on the mmap path
+
+    double failure_percent() const {
+        uint64_t attempts = allocations + injected;
+        return attempts ? 100. * injected / attempts : 0;
+    }
+};
+
+double mib(uint64_t bytes) { return double(bytes) / (1 << 20); }
+
+int main(int argc, char* argv[]) {
+    size_t top = 20;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if      (arg.compare(0, 6, "--top=") == 0) top = size_t(atol(argv[i] + 6));
+        else if (!path && arg[0] != '-')           path = argv[i];
+        else path = nullptr, i = argc;
+    }
+    if (!path) {
+        fprintf(stderr, "usage: %s [--top=N] LOG\n", argv[0]);
+        return 1;
+    }
+
+    babb::binlog::reader in(path);
+    if (!in.ok()) {
+        fprintf(stderr, "%s is not a babb log this tool can read\n", path);
+        return 1;
+    }
+
+    vector<counts> threads;
+    unordered_map<uint64_t, counts> sites;
+    counts total;
+    uint64_t events = 0, last_ticks = in.header().start_ticks;
+
+    babb::binlog::event e;
+    while (in.next(e)) {
+        ++events;
+        last_ticks = max(last_ticks, e.ticks);
+        if (e.thread >= threads.size()) threads.resize(e.thread + 1);
+        counts& t = threads[e.thread];
+        switch (e.tag) {
+        case babb::binlog::tag_alloc: {
+            counts& s = sites[e.site];
+            ++t.allocations, ++s.allocations, ++total.allocations;
+            t.bytes += e.size, s.bytes += e.size, total.bytes += e.size;
+            break;
+        }
+        case babb::binlog::tag_free:
+            ++t.frees, ++total.frees;
+            break;
+        case babb::binlog::tag_inject: {
+            counts& s = sites[e.site];
+            ++t.injected, ++s.injected, ++total.injected;
+            if (e.path == babb::paths::mapped) ++t.injected_mapped, ++s.injected_mapped, ++total.injected_mapped;
+            break;
+        }
+        }
+    }
+
+    const babb::binlog::file_header& h = in.header();
+    printf("%s: format version %u, %llu events from %zu threads", path, h.version, (unsigned long long)events, threads.size());
+    if (h.ticks_per_second)
+        printf(", %.3f s", double(last_ticks - h.start_ticks) / h.ticks_per_second);
+    printf("\n");
+    if (in.damaged())
+        printf("warning: the log is truncated or corrupt, summarizing what could be read\n");
+    if (in.skipped_chunks())
+        printf("warning: %llu chunks were cut short at events this tool does not understand\n", (unsigned long long)in.skipped_chunks());
+
+    printf("\n%-8s %12s %12s %10s %10s %8s %8s\n", "thread", "allocs", "frees", "MiB", "injected", "mapped", "fail %");
+    auto row = [](const char* name, const counts& c) {
+        printf("%-8s %12llu %12llu %10.1f %10llu %8llu %8.3f\n", name,
+            (unsigned long long)c.allocations, (unsigned long long)c.frees, mib(c.bytes),
+            (unsigned long long)c.injected, (unsigned long long)c.injected_mapped, c.failure_percent());
+    };
+    for (size_t i = 0; i < threads.size(); ++i)
+        row(to_string(i).c_str(), threads[i]);
+    row("all", total);
+
+    vector<pair<uint64_t, counts>> ranked(sites.begin(), sites.end());
+    sort(ranked.begin(), ranked.end(), [](const pair<uint64_t, counts>& a, const pair<uint64_t, counts>& b) {
+        return a.second.injected != b.second.injected ? a.second.injected > b.second.injected
+                                                      : a.second.allocations > b.second.allocations;
+    });
+    if (ranked.size() > top) ranked.resize(top);
+
+    printf("\n%zu of %zu call sites, most injected failures first:\n", ranked.size(), sites.size());
+    printf("%-18s %12s %10s %10s %8s %8s\n", "site", "allocs", "MiB", "injected", "mapped", "fail %");
+    for (auto& s : ranked)
+        printf("%#-18llx %12llu %10.1f %10llu %8llu %8.3f\n", (unsigned long long)s.first,
+            (unsigned long long)s.second.allocations, mib(s.second.bytes),
+            (unsigned long long)s.second.injected, (unsigned long long)s.second.injected_mapped,
+            s.second.failure_percent());
+}
@@ -0,0 +1,358 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+//----------------------------------------------------------------------------
+//  Microbenchmarks for babb's own overhead
+//
+//  Build with optimizations together with babb.cpp and new_replacements.cpp
+//  (or link the babb library, see CMakeLists.txt), e.g.:
+//      g++ -O2 -std=c++17 bench.cpp babb.cpp new_replacements.cpp
+//----------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <random>
+using namespace std;
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "babb.h"
+#include "babb_log.h"
+
+volatile int sink;
+
+template<class F>
+double ns_per_op(long ops, F f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    auto stop = chrono::steady_clock::now();
+    return chrono::duration<double, nano>(stop - start).count() / ops;
+}
+
+
+//----------------------------------------------------------------------------
+//  Guards: every "library entry point" on a deep call path opens a guard
+//  and then makes one injection check, as README suggests for OOM-unsafe
+//  third-party libraries
+//----------------------------------------------------------------------------
+
+constexpr int depth = 32;
+
+int nested_state_guard(int d) {
+    babb::state_guard save(babb::this_thread);
+    babb::this_thread.pause(true);
+    sink = babb::this_thread.should_inject_random_failure();
+    return d == 0 ? 0 : 1 + nested_state_guard(d - 1);
+}
+
+int nested_pause_guard(int d) {
+    babb::pause_guard pause(babb::this_thread);
+    sink = babb::this_thread.should_inject_random_failure();
+    return d == 0 ? 0 : 1 + nested_pause_guard(d - 1);
+}
+
+int nested_state_guard_profile(int d) {
+    babb::state_guard save(babb::this_thread);
+    babb::this_thread.set_failure_profile(1000 + d, 5);
+    sink = babb::this_thread.should_inject_random_failure();
+    return d == 0 ? 0 : 1 + nested_state_guard_profile(d - 1);
+}
+
+int nested_profile_guard(int d) {
+    babb::profile_guard profile(babb::this_thread, 1000 + d, 5);
+    sink = babb::this_thread.should_inject_random_failure();
+    return d == 0 ? 0 : 1 + nested_profile_guard(d - 1);
+}
+
+void bench_guards() {
+    constexpr long iterations = 200000;
+    constexpr long ops = iterations * (depth + 1);
+
+    printf("===== Nested guards (depth %d), ns per guarded call:\n", depth);
+    printf("  state_guard + pause(true):          %6.2f\n",
+        ns_per_op(ops, [] { for (long i = 0; i < iterations; ++i) sink = nested_state_guard(depth); }));
+    printf("  pause_guard:                        %6.2f\n",
+        ns_per_op(ops, [] { for (long i = 0; i < iterations; ++i) sink = nested_pause_guard(depth); }));
+
+    babb::pause_guard pause(babb::this_thread);     // keep the profile runs from failing
+    printf("  state_guard + set_failure_profile:  %6.2f\n",
+        ns_per_op(ops, [] { for (long i = 0; i < iterations; ++i) sink = nested_state_guard_profile(depth); }));
+    printf("  profile_guard:                      %6.2f\n",
+        ns_per_op(ops, [] { for (long i = 0; i < iterations; ++i) sink = nested_profile_guard(depth); }));
+}
+
+
+//----------------------------------------------------------------------------
+//  The injection check as it was before run starts were decided 64 checks
+//  at a time: one draw per call. It is reached through the same kind of
+//  thread-local proxy as babb::this_thread, so only the decision differs.
+//----------------------------------------------------------------------------
+
+namespace per_call {
+    class context : public babb::state {
+        minstd_rand r{unsigned(reinterpret_cast<uintptr_t>(this))};
+        babb::run_length_policy run;
+        double random() noexcept { return 1. * r() / minstd_rand::max(); }
+    public:
+        context() : babb::state(babb::shared) { }
+        bool should_inject_random_failure(unsigned on_path = babb::paths::heap) noexcept {
+            bool inject = decide(on_path);
+            if (BABB_PROBE_ENABLED(decide)) BABB_PROBE3(decide, inject, on_path, this);
+            return inject;
+        }
+        bool decide(unsigned on_path) noexcept {
+            if (paused || pause_depth > 0 || !(targets & on_path)) return false;
+            if (--until_refresh < 0) refresh_trigger();
+            if (oom_window || recover_after) return false;      // not measured here
+            if (!run.running() && random() < trigger) run.begin(run_length, random());
+            if (run.running()) { run.step(); return true; }
+            return false;
+        }
+    };
+
+    class this_thread_ {
+        context* active;
+        bool has_own;
+        alignas(context) unsigned char own_storage[sizeof(context)];
+        context& own() noexcept {
+            if (!has_own) { ::new (static_cast<void*>(own_storage)) context(); has_own = true; }
+            return *reinterpret_cast<context*>(own_storage);
+        }
+        context& ctx() noexcept { return active ? *active : *(active = &own()); }
+    public:
+        operator babb::state&() noexcept { return ctx(); }
+        bool should_inject_random_failure() noexcept { return ctx().should_inject_random_failure(); }
+    };
+    BABB_TLS this_thread_ this_thread;
+}
+
+
+//----------------------------------------------------------------------------
+//  Injection check, per-call baseline vs batched decisions, and in the modes
+//  that start runs differently, outside any run or event
+//----------------------------------------------------------------------------
+
+void bench_oom_events() {
+    constexpr long ops = 20000000;
+    babb::state_guard save(babb::this_thread);
+    babb::this_thread.set_failure_profile(1000000000, 1);
+    babb::state_guard save_baseline(per_call::this_thread);
+    static_cast<babb::state&>(per_call::this_thread).set_failure_profile(1000000000, 1);
+
+    printf("\n===== Injection check, ns per call:\n");
+    printf("  one draw per call (baseline):       %6.2f\n",
+        ns_per_op(ops, [] { for (long i = 0; i < ops; ++i) sink = per_call::this_thread.should_inject_random_failure(); }));
+    printf("  own failure runs:                   %6.2f\n",
+        ns_per_op(ops, [] { for (long i = 0; i < ops; ++i) sink = babb::this_thread.should_inject_random_failure(); }));
+    babb::this_thread.set_recovery(1 << 20);
+    printf("  free-driven recovery:               %6.2f\n",
+        ns_per_op(ops, [] { for (long i = 0; i < ops; ++i) sink = babb::this_thread.should_inject_random_failure(); }));
+    babb::this_thread.set_recovery(0);
+    babb::this_thread.set_oom_events(chrono::milliseconds(10));
+    printf("  taking part in OOM events:          %6.2f\n",
+        ns_per_op(ops, [] { for (long i = 0; i < ops; ++i) sink = babb::this_thread.should_inject_random_failure(); }));
+}
+
+
+//----------------------------------------------------------------------------
+//  Failure channels: the cost per call of reporting injected failures by
+//  throwing vs by return value, with about one call in 100 failing
+//----------------------------------------------------------------------------
+
+struct out_of_memory {
+    size_t requested;
+    explicit out_of_memory(size_t n) : requested(n) { }
+};
+
+void bench_channels() {
+    constexpr long ops = 2000000;
+    babb::state_guard save(babb::this_thread);
+    babb::this_thread.set_failure_profile(100, 1);
+
+    printf("\n===== Failure channels (1%% failing), ns per call:\n");
+    printf("  throw bad_alloc:                    %6.2f\n", ns_per_op(ops, [] {
+        for (long i = 0; i < ops; ++i)
+            try { babb::this_thread.inject_random_failure(); } catch (const bad_alloc&) { ++sink; }
+    }));
+    printf("  throw out_of_memory(size):          %6.2f\n", ns_per_op(ops, [] {
+        for (long i = 0; i < ops; ++i)
+            try { babb::this_thread.inject_random_failure<out_of_memory>(64); } catch (const out_of_memory& e) { sink += int(e.requested); }
+    }));
+    printf("  return error_code:                  %6.2f\n", ns_per_op(ops, [] {
+        for (long i = 0; i < ops; ++i)
+            if (auto ec = babb::this_thread.inject_random_error()) sink += ec.value();
+    }));
+    printf("  callback:                           %6.2f\n", ns_per_op(ops, [] {
+        for (long i = 0; i < ops; ++i)
+            babb::this_thread.inject_random_failure_with([](size_t n) { sink += int(n); }, 64);
+    }));
+}
+
+
+//----------------------------------------------------------------------------
+//  Growing a large buffer by doubling, as a vector does: new + copy + delete
+//  vs babb::pages::reallocate, which remaps the pages instead of copying
+//----------------------------------------------------------------------------
+
+void bench_growth() {
+    constexpr size_t from = size_t(1) << 20, to = size_t(256) << 20;
+    constexpr long rounds = 5;
+    babb::pause_guard pause(babb::this_thread);
+
+    auto touch = [](char* p, size_t begin, size_t end) { for (size_t i = begin; i < end; i += 4096) p[i] = 1; };
+    double copying = ns_per_op(rounds, [&] {
+        for (long r = 0; r < rounds; ++r) {
+            char* p = new char[from];
+            touch(p, 0, from);
+            for (size_t n = from; n < to; n *= 2) {
+                char* q = new char[2 * n];
+                memcpy(q, p, n);
+                delete[] p;
+                touch(q, n, 2 * n);
+                p = q;
+            }
+            delete[] p;
+        }
+    });
+    double remapping = ns_per_op(rounds, [&] {
+        for (long r = 0; r < rounds; ++r) {
+            char* p = static_cast<char*>(babb::pages::allocate(from));
+            touch(p, 0, from);
+            for (size_t n = from; n < to; n *= 2) {
+                p = static_cast<char*>(babb::pages::reallocate(p, 2 * n));
+                touch(p, n, 2 * n);
+            }
+            babb::pages::deallocate(p);
+        }
+    });
+
+    printf("\n===== Growing a buffer from 1 MiB to 256 MiB by doubling, ms:\n");
+    printf("  new + copy + delete %8.2f   pages::reallocate %8.2f\n", copying / 1e6, remapping / 1e6);
+}
+
+
+//----------------------------------------------------------------------------
+//  Allocator loops: allocate a batch, then free it, timing each pair
+//----------------------------------------------------------------------------
+
+constexpr int batch = 1000;
+void* blocks[batch];
+
+template<class Alloc, class Free>
+double batch_ns(Alloc alloc, Free free) {
+    constexpr long rounds = 2000;
+    return ns_per_op(rounds * batch, [&] {
+        for (long r = 0; r < rounds; ++r) {
+            for (int i = 0; i < batch; ++i) blocks[i] = alloc();
+            for (int i = 0; i < batch; ++i) free(blocks[i]);
+        }
+    });
+}
+
+
+//----------------------------------------------------------------------------
+//  Trace recording overhead: the same new/delete loop with and without
+//  babb::trace recording (two events per pair)
+//----------------------------------------------------------------------------
+
+void bench_trace() {
+    babb::pause_guard pause(babb::this_thread);
+    const char* path = "bench_trace.babblog";
+
+    // the best of a few runs, as this is easily disturbed by other processes
+    auto pairs = [] {
+        double best = 1e30;
+        for (int run = 0; run < 5; ++run)
+            best = min(best, batch_ns([] { return ::operator new(64); }, [](void* p) { ::operator delete(p); }));
+        return best;
+    };
+    double plain = pairs();
+    if (!babb::trace::start(path, 1)) {
+        printf("\n===== Trace recording: not available\n");
+        return;
+    }
+    double clocked = pairs();
+    babb::trace::stop();
+    babb::trace::start(path);
+    double sampled = pairs();
+    babb::trace::stop();
+    remove(path);
+
+    // for scale: what one read of the timestamp counter costs, which depends
+    // heavily on the machine (virtual machines may trap it)
+    constexpr long reads = 1000000;
+    double clock = ns_per_op(reads, [] {
+        for (long i = 0; i < reads; ++i)
+    #if defined(__i386__) || defined(__x86_64__)
+            sink = __rdtsc() & 1;
+    #else
+            sink = chrono::steady_clock::now().time_since_epoch().count() & 1;
+    #endif
+    });
+
+    printf("\n===== Trace recording, ns per new+delete pair:\n");
+    printf("  not recording %6.2f   clock every event %6.2f   every 16th (default) %6.2f\n",
+        plain, clocked, sampled);
+    printf("  ns per event: %.2f and %.2f; one clock read %.2f\n",
+        (clocked - plain) / 2, (sampled - plain) / 2, clock);
+}
+
+
+//----------------------------------------------------------------------------
+//  Aligned vs plain operator new, with injection paused so only the
+//  allocator is measured
+//----------------------------------------------------------------------------
+
+#ifdef __cpp_aligned_new
+
+void bench_aligned() {
+    babb::pause_guard pause(babb::this_thread);
+
+    printf("\n===== Aligned allocation, ns per new+delete pair:\n");
+    for (size_t size : { 32, 64, 256, 1024 }) {
+        for (size_t align : { 32, 64 }) {
+            if (size % align) continue;
+            auto al = align_val_t(align);
+            printf("  %4zu bytes: operator new %6.2f   aligned(%zu) new %6.2f   posix_memalign %6.2f\n", size,
+                batch_ns([=] { return ::operator new(size); }, [](void* p) { ::operator delete(p); }),
+                align,
+                batch_ns([=] { return ::operator new(size, al); }, [=](void* p) { ::operator delete(p, al); }),
+                batch_ns([=] { void* p = nullptr; return posix_memalign(&p, align, size) == 0 ? p : nullptr; }, [](void* p) { ::free(p); }));
+        }
+    }
+}
+
+#endif
+
+
+int main() {
+    bench_guards();
+    bench_oom_events();
+    bench_channels();
+    bench_growth();
+    bench_trace();
+#ifdef __cpp_aligned_new
+    bench_aligned();
+#endif
+}
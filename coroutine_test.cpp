@@ -0,0 +1,111 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+//----------------------------------------------------------------------------
+//  Test of babb_coroutine.h. Needs C++20, so it is built apart from test.cpp,
+//  e.g.:
+//      g++ -O2 -std=c++20 coroutine_test.cpp babb.cpp new_replacements.cpp
+//----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cassert>
+#include <coroutine>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+using namespace std;
+
+#include "babb_coroutine.h"
+
+struct task {
+	struct promise_type : babb::coro::promise_base {
+		task get_return_object() { return {coroutine_handle<promise_type>::from_promise(*this)}; }
+		void return_void() { }
+		void unhandled_exception() { abort(); }
+	};
+	coroutine_handle<promise_type> handle;
+};
+
+// Suspends the coroutine and leaves it for whoever resumes it next
+struct hand_off {
+	coroutine_handle<>& to;
+	bool await_ready() { return false; }
+	void await_suspend(coroutine_handle<> h) { to = h; }
+	void await_resume() { }
+};
+
+coroutine_handle<> waiting;
+thread::id started_on, resumed_on;
+
+task moves_between_threads() {
+	babb::context* mine = &babb::this_thread.current();
+	babb::pause_guard paused(babb::this_thread);
+	started_on = this_thread::get_id();
+
+	co_await hand_off{waiting};
+
+	resumed_on = this_thread::get_id();
+	assert(&babb::this_thread.current() == mine && "the context moved with the coroutine");
+	assert(babb::this_thread.current().is_paused() && "and so did its pause state");
+}
+
+// Records the coroutine's first n decisions for mapped allocations
+task decides(bool* out, int n) {
+	for (int i = 0; i < n; ++i)
+		out[i] = babb::this_thread.should_inject_random_failure(babb::paths::mapped);
+	co_return;
+}
+
+int main() {
+	cout << "===== Testing coroutines that resume on another thread:\n";
+
+	babb::context* own = &babb::this_thread.current();
+	task t = moves_between_threads();
+	assert(&babb::this_thread.current() == own && "not started yet");
+
+	t.handle.resume();
+	assert(waiting && "suspended at the hand-off");
+	assert(&babb::this_thread.current() == own && "suspending reinstalls the thread's own context");
+	assert(!babb::this_thread.current().is_paused() && "which the coroutine's pause does not touch");
+
+	thread([] {
+		babb::context* other = &babb::this_thread.current();
+		waiting.resume();
+		assert(&babb::this_thread.current() == other && "finishing reinstalls that thread's context");
+		assert(!babb::this_thread.current().is_paused());
+	}).join();
+
+	assert(t.handle.done() && resumed_on != started_on);
+	assert(!t.handle.promise().babb_context.is_paused() && "the pause ended with the body");
+	t.handle.destroy();
+
+	// Siblings made with the same profile still decide independently; only
+	// mapped allocations are targeted, so making the frames cannot fail
+	{
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.set_failure_profile(2, 1);
+	babb::this_thread.set_failure_targets(babb::paths::mapped);
+	static bool first[1000], second[1000];
+	task a = decides(first, 1000), b = decides(second, 1000);
+	a.handle.resume();
+	b.handle.resume();
+	assert(!equal(begin(first), end(first), begin(second)) && "siblings do not inject in lockstep");
+	a.handle.destroy();
+	b.handle.destroy();
+	}
+	cout << "OK\n";
+}
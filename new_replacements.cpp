@@ -16,6 +16,7 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "babb.h"
+#include "babb_log.h"
 
 //----------------------------------------------------------------------------
 //
@@ -25,8 +26,51 @@
 //
 //----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <stdlib.h>
 #include <new>
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#if !defined(_WIN32) && (defined(__GLIBC__) || defined(__APPLE__))
+#define BABB_HEAP_PROFILE
+#include <execinfo.h>
+#include <cmath>
+#endif
+
+#if defined(__GLIBC__) || defined(_WIN32)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Aligned operator new exists whenever the compiler supports it
+#if !defined(HAS_ALIGNED_ALLOCATIONS) && defined(__cpp_aligned_new)
+#define HAS_ALIGNED_ALLOCATIONS
+#endif
+
+#ifdef HAS_ALIGNED_ALLOCATIONS
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
 
 namespace op_new_detail {
 
@@ -44,55 +88,1325 @@ namespace op_new_detail {
 	#endif
 		return p;
 	}
+
+	void aligned_free(void *p)
+	{
+	#if defined(_WIN32)
+		_aligned_free(p);
+	#else
+		::free(p);
+	#endif
+	}
 	
 	void throw_bad_alloc()
 	{
 		throw std::bad_alloc();
 	}
 
+	// Fails an allocation: nothrow new returns null, the rest throw, and an
+	// injected failure that is thrown starts an unwind (see babb::unwind_costs)
+	void *fail(void* site, bool injected, bool nothrow)
+	{
+		if (nothrow) return nullptr;
+		if (injected) babb::detail::begin_unwind(site);
+		throw_bad_alloc();
+		return nullptr;
+	}
+
+	//------------------------------------------------------------------------
+	//  Blocks from the (non-aligned) operator new are plain malloc blocks,
+	//  except mapped ones and ones the heap profiler samples. Those start a
+	//  page with a header recording where they came from, so their user
+	//  pointer sits sizeof(header) into a page; operator delete only reads
+	//  the header of such pointers, and the check, which depends on the
+	//  address, tells it from whatever another block has there (for glibc, a
+	//  chunk size). Reading it is safe since it shares the pointer's page.
+	//------------------------------------------------------------------------
+
+	enum block_kind : unsigned char { sampled_block, mapped_block };
+
+	struct alignas(std::max_align_t) header {
+		size_t size;		// bytes requested by the caller
+		uint32_t sample;	// heap profile bucket (see heap_sampling), 0 if not sampled
+		block_kind kind;
+		uintptr_t check;	// last, so it is what lies just before the user pointer
+	};
+
+	const uintptr_t header_magic = uintptr_t(0xB4BB5AFE7A66EDB1ull);
+
+	header* header_of(void* p) { return static_cast<header*>(p) - 1; }
+	void*   user_of(header* h) { return h + 1; }
+
+	void *heap_malloc(size_t size) { return op_new_detail::malloc(size); }
+
+	// Usable size of a plain block, or 0 where the system allocator does not say
+	size_t usable_size(void* p)
+	{
+	#if defined(__GLIBC__)
+		return ::malloc_usable_size(p);
+	#elif defined(__APPLE__)
+		return ::malloc_size(p);
+	#elif defined(_WIN32)
+		return ::_msize(p);
+	#else
+		(void)p;
+		return 0;
+	#endif
+	}
+
+	header* init_header(void* m, size_t size, block_kind kind)
+	{
+		header* h = static_cast<header*>(m);
+		h->size = size;
+		h->sample = 0;
+		h->kind = kind;
+		h->check = uintptr_t(h) ^ header_magic;
+		return h;
+	}
+
+	//------------------------------------------------------------------------
+	//  Large blocks are mapped directly, so failures here behave (and can
+	//  be injected) like the real thing: mmap reporting ENOMEM
+	//------------------------------------------------------------------------
+
+	// Defined with the trace recorder below
+	inline bool tracing_active();
+	inline void trace_inject(size_t size, size_t alignment, unsigned path, void* site);
+
+#if !defined(_WIN32)
+
+	const size_t huge_page_size = size_t(2) << 20;
+
+	size_t page_size()
+	{
+		static const size_t size = size_t(::sysconf(_SC_PAGESIZE));
+		return size;
+	}
+
+	size_t round_up(size_t n, size_t to) { return (n + to - 1) / to * to; }
+
+	size_t mapped_length(size_t size) { return round_up(size + sizeof(header), page_size()); }
+
+	bool is_large(size_t size) { return babb::mapping.threshold && size >= babb::mapping.threshold; }
+
+	void *map_pages(size_t length, size_t size, void* site, bool* injected = nullptr)
+	{
+		if (babb::this_thread.should_inject_random_failure(babb::paths::mapped)) {
+			if (tracing_active()) trace_inject(size, 0, babb::paths::mapped, site);
+			babb::this_thread.current().report_injection(size, site, babb::paths::mapped);
+			if (injected) *injected = true;
+			errno = ENOMEM;
+			return nullptr;
+		}
+
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	#if defined(MAP_POPULATE)
+		if (babb::mapping.populate) flags |= MAP_POPULATE;
+	#endif
+
+	#if defined(MADV_HUGEPAGE)
+		if (babb::mapping.transparent_huge_pages && length >= huge_page_size) {
+			// Over-map so we can trim to a 2 MiB boundary, which THP needs
+			size_t padded = length + huge_page_size - page_size();
+			void* m = ::mmap(nullptr, padded, PROT_READ | PROT_WRITE, flags, -1, 0);
+			if (m == MAP_FAILED) return nullptr;
+			char* base = static_cast<char*>(m);
+			char* aligned = reinterpret_cast<char*>(round_up(reinterpret_cast<size_t>(base), huge_page_size));
+			if (aligned != base) ::munmap(base, aligned - base);
+			if (aligned + length != base + padded) ::munmap(aligned + length, base + padded - (aligned + length));
+			::madvise(aligned, length, MADV_HUGEPAGE);
+			return aligned;
+		}
+	#endif
+
+		void* m = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+		return m == MAP_FAILED ? nullptr : m;
+	}
+
+	void *mapped_malloc(size_t size, void* site, bool& injected)
+	{
+		injected = false;
+		if (size > SIZE_MAX - page_size() - sizeof(header)) return nullptr;
+		void* m = map_pages(mapped_length(size), size, site, &injected);
+		return m ? user_of(init_header(m, size, mapped_block)) : nullptr;
+	}
+
+	// A heap block with a header, for the heap profiler to sample
+	void *sampled_malloc(size_t size)
+	{
+		if (size > SIZE_MAX - sizeof(header)) return nullptr;
+		void* m = aligned_malloc(size + sizeof(header), page_size());
+		return m ? user_of(init_header(m, size, sampled_block)) : nullptr;
+	}
+
+	// Pages are at least min_page_size, so any page start is aligned to it
+	const uintptr_t min_page_size = 4096;
+
+	header* tagged_header(void* p)
+	{
+		if ((reinterpret_cast<uintptr_t>(p) & (min_page_size - 1)) != sizeof(header)) return nullptr;
+		header* h = header_of(p);
+		return h->check == (uintptr_t(h) ^ header_magic) ? h : nullptr;
+	}
+
+#else
+
+	bool  is_large(size_t)      { return false; }
+	void *mapped_malloc(size_t, void*, bool&) { return nullptr; }
+	void *sampled_malloc(size_t size) { return heap_malloc(size); }
+	header* tagged_header(void*) { return nullptr; }
+
+#endif
+
+	//------------------------------------------------------------------------
+	//  Allocation trace recording (see babb::trace in babb_log.h)
+	//
+	//  Each thread encodes events into a chunk buffer of its own, mapped the
+	//  first time it records, and appends full chunks to the file with pwrite
+	//  at an atomically reserved offset. The thread finds its buffer through
+	//  a plain BABB_TLS pointer, so an event costs no TLS wrapper call and no
+	//  interlocked instruction: the owner only publishes the new end of its
+	//  chunk with an ordinary (release) store. Reading the clock can cost
+	//  more than the rest of an event (virtual machines often trap rdtsc),
+	//  so a thread reads it once every clock_every events and stamps the
+	//  ones in between with the last reading.
+	//
+	//  Everything else that touches a buffer (flushing it, starting a new
+	//  session in it, freeing it when its thread exits) holds registry_lock.
+	//  trace::stop() writes out what the other threads have published so far
+	//  without waiting for them; an event still being encoded is left out,
+	//  as if it had happened after stop().
+	//------------------------------------------------------------------------
+
+#if !defined(_WIN32)
+
+	namespace tracing {
+
+		const size_t buffer_bytes = size_t(64) << 10;
+		const size_t max_event_bytes = 1 + 5 * 10;
+
+		std::atomic<bool> active{false};
+		std::atomic<unsigned> session{0};	// changed under registry_lock
+		std::atomic<uint64_t> file_end{0};
+		int fd = -1;						// under registry_lock
+		uint32_t threads = 0;				// under registry_lock
+		std::atomic<uint32_t> clock_every{1};
+		uint64_t start_ticks = 0;
+		std::chrono::steady_clock::time_point start_time;
+
+		inline uint64_t ticks()
+		{
+		#if defined(__i386__) || defined(__x86_64__)
+			return __rdtsc();
+		#else
+			return uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+		#endif
+		}
+
+		struct buffer {
+			std::atomic<uint8_t*> end{nullptr};	// events published so far
+			uint8_t* at = nullptr;				// the owner's copy of end
+			unsigned session_id = 0;
+			uint32_t thread = 0;
+			uint32_t events = 0;
+			uint32_t until_clock = 0;			// events to stamp before the next reading
+			uint64_t first_ticks = 0;
+			uint64_t last_ticks = 0, last_ptr = 0, last_site = 0;
+			buffer* next = nullptr;				// in the registry
+			alignas(8) uint8_t data[buffer_bytes];	// chunk header, then events
+		};
+
+		std::mutex registry_lock;
+		buffer* registry = nullptr;
+
+		BABB_TLS buffer* local = nullptr;
+		BABB_TLS bool exited = false;
+
+		// The following take registry_lock, except for the owner's own fields
+
+		void begin_chunk(buffer* b, uint64_t now)
+		{
+			b->at = b->data + sizeof(babb::binlog::chunk_header);
+			b->end.store(b->at, std::memory_order_release);
+			b->events = 0;
+			b->first_ticks = b->last_ticks = now;
+			b->last_ptr = b->last_site = 0;
+		}
+
+		// Writes the first events events of b's chunk, up to end, if the
+		// chunk belongs to the current session
+		void write_chunk(buffer* b, const uint8_t* end, uint32_t events)
+		{
+			if (fd < 0 || events == 0 || b->session_id != session.load(std::memory_order_relaxed)) return;
+			babb::binlog::chunk_header h;
+			h.magic = babb::binlog::chunk_magic;
+			h.payload_bytes = uint32_t(end - b->data - sizeof(h));
+			h.thread = b->thread;
+			h.events = events;
+			h.first_ticks = b->first_ticks;
+			babb::binlog::little_endian(h);
+			memcpy(b->data, &h, sizeof(h));
+			size_t length = size_t(end - b->data);
+			off_t offset = off_t(file_end.fetch_add(length, std::memory_order_relaxed));
+			if (::pwrite(fd, b->data, length, offset) != ssize_t(length))
+				active.store(false, std::memory_order_relaxed);		// disk full or similar: stop quietly
+		}
+
+		// The owner's flush, of everything in its chunk
+		void flush(buffer* b)
+		{
+			write_chunk(b, b->at, b->events);
+			begin_chunk(b, ticks());
+		}
+
+		// Anyone else's: only what the owner has published, counted by decoding
+		void flush_published(buffer* b)
+		{
+			const uint8_t* end = b->end.load(std::memory_order_acquire);
+			babb::binlog::chunk_header h;
+			h.payload_bytes = uint32_t(end - b->data - sizeof(h));
+			h.thread = b->thread;
+			h.first_ticks = b->first_ticks;
+			babb::binlog::chunk_reader events(h, b->data + sizeof(h));
+			babb::binlog::event e;
+			uint32_t n = 0;
+			while (events.next(e)) ++n;
+			write_chunk(b, end, n);
+		}
+
+		struct owner {
+			buffer* b = nullptr;
+			~owner()
+			{
+				local = nullptr;
+				exited = true;
+				if (!b) return;
+				{
+					std::lock_guard<std::mutex> hold(registry_lock);
+					flush(b);
+					for (buffer** link = &registry; *link; link = &(*link)->next)
+						if (*link == b) { *link = b->next; break; }
+				}
+				::munmap(b, sizeof(buffer));
+			}
+		};
+		thread_local owner exiting;
+
+		// Once per thread
+		buffer* adopt()
+		{
+			void* m = ::mmap(nullptr, sizeof(buffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (m == MAP_FAILED) return nullptr;
+			buffer* b = ::new (m) buffer;
+			{
+				std::lock_guard<std::mutex> hold(registry_lock);
+				b->thread = threads++;
+				b->session_id = session.load(std::memory_order_relaxed);
+				begin_chunk(b, ticks());
+				b->next = registry;
+				registry = b;
+			}
+			exiting.b = b;
+			return local = b;
+		}
+
+		// Returns the calling thread's buffer, with room for one more event;
+		// or nullptr if the event should be dropped
+		inline buffer* acquire()
+		{
+			buffer* b = local;
+			if (!b && (exited || !(b = adopt()))) return nullptr;
+			if (b->session_id != session.load(std::memory_order_relaxed)
+				|| size_t(b->data + buffer_bytes - b->at) < max_event_bytes) {
+				// events left over from an earlier session are discarded
+				std::lock_guard<std::mutex> hold(registry_lock);
+				if (b->session_id != session.load(std::memory_order_relaxed)) {
+					b->session_id = session.load(std::memory_order_relaxed);
+					begin_chunk(b, ticks());
+				}
+				else flush(b);
+			}
+			return b;
+		}
+
+		inline uint64_t stamp(buffer* b)
+		{
+			if (b->until_clock != 0) { --b->until_clock; return b->last_ticks; }
+			b->until_clock = clock_every.load(std::memory_order_relaxed) - 1;
+			return ticks();
+		}
+
+		inline void release(buffer* b, uint8_t* out)
+		{
+			b->at = out;
+			++b->events;
+			b->end.store(out, std::memory_order_release);
+		}
+
+		void record_alloc(void* p, size_t size, size_t alignment, void* site)
+		{
+			buffer* b = acquire();
+			if (!b) return;
+			uint64_t now = stamp(b), ptr = uint64_t(uintptr_t(p)), where = uint64_t(uintptr_t(site));
+			uint8_t* out = b->at;
+			*out++ = babb::binlog::tag_alloc;
+			out = babb::binlog::put_varint(out, now - b->last_ticks);
+			out = babb::binlog::put_signed(out, int64_t(ptr - b->last_ptr));
+			out = babb::binlog::put_varint(out, size);
+			int align_log2 = 0;
+			while ((size_t(1) << align_log2) < alignment) ++align_log2;
+			*out++ = uint8_t(align_log2);
+			out = babb::binlog::put_signed(out, int64_t(where - b->last_site));
+			b->last_ticks = now;
+			b->last_ptr = ptr;
+			b->last_site = where;
+			release(b, out);
+		}
+
+		void record_free(void* p, size_t size)
+		{
+			buffer* b = acquire();
+			if (!b) return;
+			uint64_t now = stamp(b), ptr = uint64_t(uintptr_t(p));
+			uint8_t* out = b->at;
+			*out++ = babb::binlog::tag_free;
+			out = babb::binlog::put_varint(out, now - b->last_ticks);
+			out = babb::binlog::put_signed(out, int64_t(ptr - b->last_ptr));
+			out = babb::binlog::put_varint(out, size);
+			b->last_ticks = now;
+			b->last_ptr = ptr;
+			release(b, out);
+		}
+
+		void record_inject(size_t size, size_t alignment, unsigned path, void* site)
+		{
+			buffer* b = acquire();
+			if (!b) return;
+			uint64_t now = stamp(b), where = uint64_t(uintptr_t(site));
+			uint8_t* out = b->at;
+			*out++ = babb::binlog::tag_inject;
+			out = babb::binlog::put_varint(out, now - b->last_ticks);
+			out = babb::binlog::put_varint(out, size);
+			int align_log2 = 0;
+			while ((size_t(1) << align_log2) < alignment) ++align_log2;
+			*out++ = uint8_t(align_log2);
+			*out++ = uint8_t(path);
+			out = babb::binlog::put_signed(out, int64_t(where - b->last_site));
+			b->last_ticks = now;
+			b->last_site = where;
+			release(b, out);
+		}
+
+		bool write_file_header(int out, uint64_t first_ticks, uint64_t ticks_per_second)
+		{
+			babb::binlog::file_header h;
+			memcpy(h.magic, babb::binlog::magic, sizeof(h.magic));
+			h.version = babb::binlog::version;
+			h.header_bytes = sizeof(h);
+			h.ticks_per_second = ticks_per_second;
+			h.start_ticks = first_ticks;
+			babb::binlog::little_endian(h);
+			return ::pwrite(out, &h, sizeof(h), 0) == ssize_t(sizeof(h));
+		}
+
+	}
+
+	inline bool tracing_active() { return tracing::active.load(std::memory_order_relaxed); }
+	inline void trace_alloc(void* p, size_t size, size_t alignment, void* site) { tracing::record_alloc(p, size, alignment, site); }
+	inline void trace_free(void* p, size_t size) { tracing::record_free(p, size); }
+	inline void trace_inject(size_t size, size_t alignment, unsigned path, void* site) { tracing::record_inject(size, alignment, path, site); }
+
+#else
+
+	inline bool tracing_active() { return false; }
+	inline void trace_alloc(void*, size_t, size_t, void*) { }
+	inline void trace_free(void*, size_t) { }
+	inline void trace_inject(size_t, size_t, unsigned, void*) { }
+
+#endif
+
+	//------------------------------------------------------------------------
+	//  Injection event log (see babb::injection_log in babb_log.h)
+	//
+	//  Each thread that injects a failure gets a ring of raw events in a
+	//  mapping of its own, and one flusher thread drains all the rings. Only
+	//  the owner moves a ring's head and only the flusher moves its tail, so
+	//  neither ever waits for the other; an event that finds its ring full
+	//  is counted and dropped. Each pass, the flusher encodes what it took
+	//  from each ring as one log chunk and writes the whole batch with one
+	//  write. A ring outlives its thread until the flusher has emptied it.
+	//  Rings are pushed onto the registry without a lock, so a thread that
+	//  injects for the first time never waits for a write in progress.
+	//------------------------------------------------------------------------
+
+#if !defined(_WIN32)
+
+	namespace injection_logging {
+
+		struct ring {
+			static const uint32_t capacity = 4096;		// a power of 2
+
+			struct entry {
+				uint64_t ticks;
+				uint64_t size;
+				uint64_t site;
+				unsigned path;
+			};
+
+			alignas(64) std::atomic<uint32_t> head{0};	// next entry the owner fills
+			alignas(64) std::atomic<uint32_t> tail{0};	// next entry the flusher takes
+			std::atomic<uint64_t> dropped{0};
+			std::atomic<bool> orphaned{false};			// the owner has exited
+			uint32_t thread = 0;
+			ring* next = nullptr;						// in the registry; set before publishing, then only by drain
+			entry entries[capacity];
+		};
+
+		const size_t batch_bytes = size_t(1) << 20;
+		const size_t max_event_bytes = 1 + 3 * 10 + 2;
+
+		int fd = -1;
+		bool failed = false;				// a write failed: drain, but write no more
+		uint8_t* batch = nullptr;
+		uint64_t start_ticks = 0;
+		std::chrono::steady_clock::time_point start_time;
+		std::atomic<uint64_t> written{0};
+
+		std::mutex flush_lock;				// serializes draining, and walking the registry
+		std::atomic<ring*> registry{nullptr};
+		std::atomic<uint32_t> threads{0};
+		uint64_t dropped_by_exited = 0;		// under flush_lock
+
+		std::mutex control;
+		std::condition_variable wake;
+		std::thread flusher;
+		bool stopping = false;
+
+		BABB_TLS ring* local = nullptr;
+		BABB_TLS bool exited = false;
+
+		struct owner {
+			ring* r = nullptr;
+			~owner()
+			{
+				// record() must not find the ring once the flusher may free it
+				local = nullptr;
+				exited = true;
+				if (r) r->orphaned.store(true, std::memory_order_release);
+			}
+		};
+		thread_local owner exiting;
+
+		// Once per thread; the only system call an injecting thread makes
+		ring* adopt()
+		{
+			void* m = ::mmap(nullptr, sizeof(ring), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (m == MAP_FAILED) return nullptr;
+			ring* r = ::new (m) ring;
+			r->thread = threads.fetch_add(1, std::memory_order_relaxed);
+			r->next = registry.load(std::memory_order_relaxed);
+			while (!registry.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) { }
+			exiting.r = r;
+			return local = r;
+		}
+
+		// The injection logger while the log is running (see report_injection)
+		void record(size_t size, unsigned path, const void* site)
+		{
+			ring* r = local;
+			if (!r && (exited || !(r = adopt()))) return;
+			uint32_t head = r->head.load(std::memory_order_relaxed);
+			if (head - r->tail.load(std::memory_order_acquire) == ring::capacity) {
+				r->dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			ring::entry& e = r->entries[head & (ring::capacity - 1)];
+			e.ticks = tracing::ticks();
+			e.size = size;
+			e.site = uint64_t(uintptr_t(site));
+			e.path = path;
+			r->head.store(head + 1, std::memory_order_release);
+		}
+
+		void write_out(const uint8_t* end)
+		{
+			for (const uint8_t* at = batch; at < end && !failed; ) {
+				ssize_t n = ::write(fd, at, size_t(end - at));
+				if (n > 0) at += n;
+				else if (n < 0 && errno != EINTR) failed = true;		// disk full or similar: stop quietly
+			}
+		}
+
+		// Encodes n events from r's tail as one chunk at out
+		uint8_t* encode(ring* r, uint32_t tail, uint32_t n, uint8_t* out)
+		{
+			uint8_t* chunk = out;
+			out += sizeof(babb::binlog::chunk_header);
+			uint64_t first = r->entries[tail & (ring::capacity - 1)].ticks;
+			uint64_t last_ticks = first, last_site = 0;
+			for (uint32_t i = 0; i < n; ++i) {
+				const ring::entry& e = r->entries[(tail + i) & (ring::capacity - 1)];
+				*out++ = babb::binlog::tag_inject;
+				out = babb::binlog::put_varint(out, e.ticks > last_ticks ? e.ticks - last_ticks : 0);
+				out = babb::binlog::put_varint(out, e.size);
+				*out++ = 0;		// alignment unknown
+				*out++ = uint8_t(e.path);
+				out = babb::binlog::put_signed(out, int64_t(e.site - last_site));
+				last_ticks = e.ticks > last_ticks ? e.ticks : last_ticks;
+				last_site = e.site;
+			}
+			babb::binlog::chunk_header h;
+			h.magic = babb::binlog::chunk_magic;
+			h.payload_bytes = uint32_t(out - chunk - sizeof(h));
+			h.thread = r->thread;
+			h.events = n;
+			h.first_ticks = first;
+			babb::binlog::little_endian(h);
+			memcpy(chunk, &h, sizeof(h));
+			written.fetch_add(n, std::memory_order_relaxed);
+			return out;
+		}
+
+		// Takes r, which follows previous (or is the first ring the pass saw),
+		// out of the registry. Only drain unlinks, and rings are only pushed
+		// at the head, so only r's being the head can have changed.
+		void unlink(ring* r, ring* previous)
+		{
+			if (!previous) {
+				ring* head = r;
+				if (registry.compare_exchange_strong(head, r->next, std::memory_order_acquire)) return;
+				for (previous = head; previous->next != r; previous = previous->next) { }
+			}
+			previous->next = r->next;
+		}
+
+		// Empties every ring into the log and frees the rings of exited
+		// threads; called with flush_lock held
+		void drain()
+		{
+			uint8_t* at = batch;
+			ring* previous = nullptr;
+			for (ring* r = registry.load(std::memory_order_acquire); r; ) {
+				bool last = r->orphaned.load(std::memory_order_acquire);	// before head: no events after it
+				uint32_t tail = r->tail.load(std::memory_order_relaxed);
+				uint32_t head = r->head.load(std::memory_order_acquire);
+				while (tail != head) {
+					size_t room = size_t(batch + batch_bytes - at);
+					if (room < sizeof(babb::binlog::chunk_header) + 64 * max_event_bytes) {
+						write_out(at);
+						at = batch;
+						continue;
+					}
+					room -= sizeof(babb::binlog::chunk_header);
+					uint32_t n = std::min(head - tail, uint32_t(room / max_event_bytes));
+					at = encode(r, tail, n, at);
+					tail += n;
+					r->tail.store(tail, std::memory_order_release);
+				}
+				ring* next = r->next;
+				if (last) {
+					unlink(r, previous);
+					dropped_by_exited += r->dropped.load(std::memory_order_relaxed);
+					::munmap(r, sizeof(ring));
+				}
+				else previous = r;
+				r = next;
+			}
+			write_out(at);
+		}
+
+		// A running std::thread must not be destroyed, so stop at exit
+		struct stop_at_exit { ~stop_at_exit() { babb::injection_log::stop(); } } stopper;
+
+	}
+
+#endif
+
+	//------------------------------------------------------------------------
+	//  Sampling heap profiler (see babb::heap_profile in babb_log.h)
+	//
+	//  Each thread counts its allocated bytes down from a random credit,
+	//  drawn from an exponential distribution with mean sample_every, and
+	//  samples the allocation that overdraws it; by memorylessness a block of
+	//  n bytes is then sampled with probability 1 - exp(-n/sample_every),
+	//  which is what pprof assumes for heap_v2 profiles. While the profiler
+	//  is off the credit is topped up by idle_recheck instead.
+	//
+	//  Sampled allocations are counted by call stack in buckets. Whether to
+	//  sample is decided before allocating, so a sampled block can be given
+	//  a header in which to record its bucket, and operator delete finds it
+	//  without a lookup. Buckets live in one mapping that is never freed,
+	//  since blocks sampled before stop() may be freed any time later; they
+	//  are only ever added to, under a lock that sampling threads take.
+	//------------------------------------------------------------------------
+
+#if defined(BABB_HEAP_PROFILE)
+
+	namespace heap_sampling {
+
+		const int max_depth = 32;
+		const int skip_depth = 8;				// frames inside babb to look through for the site
+		const uint32_t max_buckets = uint32_t(1) << 16;
+		const uint32_t table_slots = max_buckets * 2;	// a power of 2
+		const int64_t idle_recheck = int64_t(1) << 20;
+
+		struct bucket {
+			std::atomic<int64_t> live_count{0};
+			std::atomic<int64_t> live_bytes{0};
+			int64_t alloc_count = 0;			// since start(), under lock
+			int64_t alloc_bytes = 0;
+			uint64_t hash = 0;
+			int depth = 0;
+			void* frames[max_depth];
+		};
+
+		std::atomic<int64_t> period{0};			// sample_every, 0 while stopped
+		std::atomic<uint64_t> sampled{0};
+		std::atomic<uint64_t> dropped{0};
+
+		std::mutex lock;
+		bucket* buckets = nullptr;				// buckets[i - 1] is bucket number i
+		uint32_t* table = nullptr;				// open addressing, bucket numbers
+		uint32_t used = 0;
+		int64_t profiled_every = 1;				// the last start()'s, for write()
+
+		BABB_TLS int64_t credit = 0;
+		BABB_TLS uint64_t random_state = 0;
+		BABB_TLS bool sampling = false;			// the sampler itself allocates (backtrace may)
+
+		// xorshift64*, good enough to space samples out
+		double uniform()
+		{
+			if (!random_state) random_state = (uint64_t(uintptr_t(&random_state)) ^ tracing::ticks()) | 1;
+			random_state ^= random_state >> 12;
+			random_state ^= random_state << 25;
+			random_state ^= random_state >> 27;
+			return double((random_state * 0x2545F4914F6CDD1Dull) >> 11) * (1. / 9007199254740992.);
+		}
+
+		int64_t next_credit(int64_t every)
+		{
+			double bytes = -std::log(1. - uniform()) * double(every);
+			return bytes < 9e18 ? int64_t(bytes) : INT64_MAX;
+		}
+
+		bool reserve()
+		{
+			if (buckets) return true;
+			size_t bytes = max_buckets * sizeof(bucket) + table_slots * sizeof(uint32_t);
+			void* m = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (m == MAP_FAILED) return false;
+			buckets = static_cast<bucket*>(m);
+			table = reinterpret_cast<uint32_t*>(buckets + max_buckets);
+			return true;
+		}
+
+		// Returns the number of the bucket for this stack, 0 if the table is full
+		uint32_t intern(void* const* frames, int depth, size_t size)
+		{
+			uint64_t hash = 14695981039346656037ull;
+			for (int i = 0; i < depth; ++i)
+				hash = (hash ^ uint64_t(uintptr_t(frames[i]))) * 1099511628211ull;
+
+			std::lock_guard<std::mutex> hold(lock);
+			for (uint32_t slot = uint32_t(hash) & (table_slots - 1); ; slot = (slot + 1) & (table_slots - 1)) {
+				uint32_t n = table[slot];
+				if (n == 0) {
+					if (used == max_buckets) return 0;
+					bucket* b = ::new (&buckets[used]) bucket;
+					b->hash = hash;
+					b->depth = depth;
+					std::copy(frames, frames + depth, b->frames);
+					table[slot] = n = ++used;
+				}
+				bucket& b = buckets[n - 1];
+				if (b.hash == hash && b.depth == depth && std::equal(frames, frames + depth, b.frames)) {
+					++b.alloc_count;
+					b.alloc_bytes += int64_t(size);
+					b.live_count.fetch_add(1, std::memory_order_relaxed);
+					b.live_bytes.fetch_add(int64_t(size), std::memory_order_relaxed);
+					return n;
+				}
+			}
+		}
+
+		// Called when an allocation overdraws the credit; says whether to sample it
+		bool overdrawn()
+		{
+			int64_t every = period.load(std::memory_order_relaxed);
+			if (every <= 0) {
+				credit = idle_recheck;
+				return false;
+			}
+			credit = next_credit(every);
+			return !sampling;
+		}
+
+		BABB_NOINLINE void sample(void* p, size_t size, void* site)
+		{
+			sampling = true;
+
+			// Start the stack at operator new's caller
+			void* frames[skip_depth + max_depth];
+			int depth = ::backtrace(frames, skip_depth + max_depth);
+			int first = 0;
+			while (first < depth && first < skip_depth && frames[first] != site) ++first;
+			if (first == depth || first == skip_depth) {
+				frames[0] = site;
+				first = 0;
+				depth = 1;
+			}
+			depth = std::min(depth - first, max_depth);
+
+			if (uint32_t n = intern(frames + first, depth, size)) {
+				header_of(p)->sample = n;
+				sampled.fetch_add(1, std::memory_order_relaxed);
+			}
+			else dropped.fetch_add(1, std::memory_order_relaxed);
+			sampling = false;
+		}
+
+		void unsample(uint32_t n, size_t size)
+		{
+			bucket& b = buckets[n - 1];
+			b.live_count.fetch_sub(1, std::memory_order_relaxed);
+			b.live_bytes.fetch_sub(int64_t(size), std::memory_order_relaxed);
+		}
+
+		// Buffered output that needs no heap
+		struct writer {
+			int fd;
+			bool ok = true;
+			size_t used = 0;
+			char data[8192];
+
+			explicit writer(int out) : fd(out) { }
+
+			void flush()
+			{
+				for (size_t at = 0; at < used && ok; ) {
+					ssize_t n = ::write(fd, data + at, used - at);
+					if (n > 0) at += size_t(n);
+					else if (n < 0 && errno != EINTR) ok = false;
+				}
+				used = 0;
+			}
+
+			// length is at most sizeof(data)
+			void put(const char* text, size_t length)
+			{
+				if (sizeof(data) - used < length) flush();
+				memcpy(data + used, text, length);
+				used += length;
+			}
+
+			template<class... Args>
+			void print(const char* format, Args... args)
+			{
+				char line[128];
+				int n = snprintf(line, sizeof(line), format, args...);
+				if (n > 0) put(line, std::min(size_t(n), sizeof(line) - 1));
+			}
+		};
+
+		void write_stack(writer& out, const bucket& b, int64_t live_count, int64_t live_bytes)
+		{
+			out.print("%6lld: %8lld [%6lld: %8lld] @", (long long)live_count, (long long)live_bytes,
+				(long long)b.alloc_count, (long long)b.alloc_bytes);
+			for (int i = 0; i < b.depth; ++i)
+				out.print(" %p", b.frames[i]);
+			out.put("\n", 1);
+		}
+
+		// pprof symbolizes against the mappings
+		void write_mappings(writer& out)
+		{
+		#if defined(__linux__)
+			int maps = ::open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+			if (maps < 0) return;
+			out.put("\nMAPPED_LIBRARIES:\n", 19);
+			char chunk[4096];
+			ssize_t n;
+			while ((n = ::read(maps, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR))
+				if (n > 0) out.put(chunk, size_t(n));
+			::close(maps);
+		#else
+			(void)out;
+		#endif
+		}
+
+	}
+
+#endif
+
+	// Static tracepoints (see BABB_PROBE2 in babb.h)
+	inline void probe_new(void* p, size_t size, size_t alignment, void* site)
+	{
+		if (BABB_PROBE_ENABLED(new)) BABB_PROBE4(new, p, size, alignment, site);
+	}
+
+	inline void probe_delete(void* p, size_t size)
+	{
+		if (BABB_PROBE_ENABLED(delete)) BABB_PROBE2(delete, p, size);
+	}
+
+	//------------------------------------------------------------------------
+	//  Resizable page blocks (see babb::pages). The header records the
+	//  requested size and the mapped length, which only grows: shrinking
+	//  gives the tail pages back to the OS but keeps them reserved.
+	//------------------------------------------------------------------------
+
+	struct alignas(std::max_align_t) page_header {
+		size_t size;		// bytes requested by the caller
+		size_t length;		// bytes mapped, including this header
+	};
+
+	page_header* page_header_of(void* p) { return static_cast<page_header*>(p) - 1; }
+
+	// Sizing a plain block is a lookup in malloc's own metadata, so it is only
+	// done when something needs the size: the run-length policy, free-driven
+	// recovery, the trace or the delete probe. Sized delete passes it in.
+	void block_free(void* p, size_t size = 0)
+	{
+		if (!p) return;
+		if (header* h = tagged_header(p)) {
+			babb::released(h->size);
+			if (babb::run_length_policy::counts_frees) babb::this_thread.note_free(h->size);
+			if (tracing_active()) trace_free(p, h->size);
+			probe_delete(p, h->size);
+		#if defined(BABB_HEAP_PROFILE)
+			if (h->sample) heap_sampling::unsample(h->sample, h->size);
+		#endif
+		#if !defined(_WIN32)
+			if (h->kind == mapped_block) {
+				::munmap(h, mapped_length(h->size));
+				return;
+			}
+		#endif
+			aligned_free(h);
+			return;
+		}
+
+		bool tracing = tracing_active();
+		if (babb::run_length_policy::counts_frees || babb::this_thread.current().recovers_on_frees()
+			|| babb::detail::recovery_target.load(std::memory_order_relaxed)
+			|| tracing || BABB_PROBE_ENABLED(delete)) {
+			if (!size) size = usable_size(p);
+			babb::released(size);
+			if (babb::run_length_policy::counts_frees) babb::this_thread.note_free(size);
+			if (tracing) trace_free(p, size);
+			probe_delete(p, size);
+		}
+		op_new_detail::free(p);
+	}
+
+	void *new_impl(size_t size, void* site, bool nothrow = false);
+
+}
+
+#if !defined(_WIN32)
+
+bool babb::trace::start(const char* path, unsigned clock_every) noexcept
+{
+	using namespace op_new_detail::tracing;
+	stop();
+	op_new_detail::tracing::clock_every.store(clock_every ? clock_every : 1, std::memory_order_relaxed);
+	int out = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) return false;
+	start_time = std::chrono::steady_clock::now();
+	start_ticks = ticks();
+	if (!write_file_header(out, start_ticks, 0)) {
+		::close(out);
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> hold(registry_lock);
+		file_end.store(sizeof(babb::binlog::file_header), std::memory_order_relaxed);
+		session.fetch_add(1, std::memory_order_relaxed);
+		fd = out;
+	}
+	active.store(true, std::memory_order_release);
+	return true;
+}
+
+void babb::trace::stop() noexcept
+{
+	using namespace op_new_detail::tracing;
+	active.store(false, std::memory_order_relaxed);
+	std::lock_guard<std::mutex> hold(registry_lock);
+	if (fd < 0) return;
+	for (buffer* b = registry; b; b = b->next) {
+		if (b == local) flush(b);
+		else flush_published(b);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	uint64_t elapsed = ticks() - start_ticks;
+	write_file_header(fd, start_ticks, seconds > 0 ? uint64_t(elapsed / seconds) : 0);
+	::close(fd);
+	fd = -1;
+}
+
+bool babb::injection_log::start(const char* path, std::chrono::milliseconds flush_interval) noexcept
+{
+	using namespace op_new_detail::injection_logging;
+	stop();
+	babb::pause_guard bookkeeping(babb::this_thread);
+	int out = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0) return false;
+	void* m = ::mmap(nullptr, batch_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	uint64_t now = op_new_detail::tracing::ticks();
+	if (m == MAP_FAILED || !op_new_detail::tracing::write_file_header(out, now, 0)
+		|| ::lseek(out, sizeof(babb::binlog::file_header), SEEK_SET) < 0) {
+		if (m != MAP_FAILED) ::munmap(m, batch_bytes);
+		::close(out);
+		return false;
+	}
+	{
+		// Events left over from an earlier log are discarded
+		std::lock_guard<std::mutex> hold(flush_lock);
+		for (ring* r = registry.load(std::memory_order_acquire); r; r = r->next) {
+			r->tail.store(r->head.load(std::memory_order_acquire), std::memory_order_release);
+			r->dropped.store(0, std::memory_order_relaxed);
+		}
+		dropped_by_exited = 0;
+	}
+	fd = out;
+	failed = false;
+	batch = static_cast<uint8_t*>(m);
+	start_ticks = now;
+	start_time = std::chrono::steady_clock::now();
+	written.store(0, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> hold(control);
+	stopping = false;
+	try {
+		flusher = std::thread([=] {
+			babb::this_thread.pause(true);
+			std::unique_lock<std::mutex> lock(control);
+			while (!wake.wait_for(lock, flush_interval, [] { return stopping; })) {
+				lock.unlock();
+				{
+					std::lock_guard<std::mutex> draining(flush_lock);
+					drain();
+				}
+				lock.lock();
+			}
+		});
+	}
+	catch (...) {
+		::munmap(batch, batch_bytes);
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	babb::detail::log_injection.store(&record, std::memory_order_release);
+	return true;
+}
+
+void babb::injection_log::stop() noexcept
+{
+	using namespace op_new_detail::injection_logging;
+	babb::detail::log_injection.store(nullptr, std::memory_order_release);
+	std::thread finished;
+	{
+		std::lock_guard<std::mutex> hold(control);
+		stopping = true;
+		finished.swap(flusher);
+	}
+	wake.notify_all();
+	if (finished.joinable()) finished.join();
+	if (fd < 0) return;
+
+	std::lock_guard<std::mutex> hold(flush_lock);
+	drain();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	uint64_t elapsed = op_new_detail::tracing::ticks() - start_ticks;
+	if (!failed) op_new_detail::tracing::write_file_header(fd, start_ticks, seconds > 0 ? uint64_t(elapsed / seconds) : 0);
+	::close(fd);
+	fd = -1;
+	::munmap(batch, batch_bytes);
+	batch = nullptr;
+}
+
+babb::injection_log::statistics babb::injection_log::stats() noexcept
+{
+	using namespace op_new_detail::injection_logging;
+	statistics s;
+	s.written = written.load(std::memory_order_relaxed);
+	std::lock_guard<std::mutex> hold(flush_lock);
+	s.dropped = dropped_by_exited;
+	for (ring* r = registry.load(std::memory_order_acquire); r; r = r->next)
+		s.dropped += r->dropped.load(std::memory_order_relaxed);
+	return s;
+}
+
+#else
+
+bool babb::trace::start(const char*, unsigned) noexcept { return false; }
+void babb::trace::stop() noexcept { }
+
+bool babb::injection_log::start(const char*, std::chrono::milliseconds) noexcept { return false; }
+void babb::injection_log::stop() noexcept { }
+babb::injection_log::statistics babb::injection_log::stats() noexcept { return statistics(); }
+
+#endif
+
+#if defined(BABB_HEAP_PROFILE)
+
+bool babb::heap_profile::start(size_t sample_every) noexcept
+{
+	using namespace op_new_detail::heap_sampling;
+	if (sample_every == 0 || sample_every > size_t(INT64_MAX)) return false;
+	std::lock_guard<std::mutex> hold(lock);
+	if (!reserve()) return false;
+	// Blocks sampled earlier stay live until freed; their allocations are
+	// only counted from here on
+	for (uint32_t i = 0; i < used; ++i) {
+		buckets[i].alloc_count = 0;
+		buckets[i].alloc_bytes = 0;
+	}
+	sampled.store(0, std::memory_order_relaxed);
+	dropped.store(0, std::memory_order_relaxed);
+	profiled_every = int64_t(sample_every);
+	period.store(int64_t(sample_every), std::memory_order_relaxed);
+	credit = 0;
+	return true;
 }
 
-void* operator new(std::size_t size)
+void babb::heap_profile::stop() noexcept
+{
+	op_new_detail::heap_sampling::period.store(0, std::memory_order_relaxed);
+}
+
+bool babb::heap_profile::write(const char* path) noexcept
+{
+	using namespace op_new_detail::heap_sampling;
+	int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return false;
+	writer out(fd);
+	{
+		std::lock_guard<std::mutex> hold(lock);
+		int64_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+		for (uint32_t i = 0; i < used; ++i) {
+			live_count += buckets[i].live_count.load(std::memory_order_relaxed);
+			live_bytes += buckets[i].live_bytes.load(std::memory_order_relaxed);
+			alloc_count += buckets[i].alloc_count;
+			alloc_bytes += buckets[i].alloc_bytes;
+		}
+		out.print("heap profile: %6lld: %8lld [%6lld: %8lld] @ heap_v2/%lld\n",
+			(long long)live_count, (long long)live_bytes, (long long)alloc_count, (long long)alloc_bytes,
+			(long long)profiled_every);
+		for (uint32_t i = 0; i < used; ++i) {
+			const bucket& b = buckets[i];
+			int64_t count = b.live_count.load(std::memory_order_relaxed);
+			int64_t bytes = b.live_bytes.load(std::memory_order_relaxed);
+			if (count || b.alloc_count) write_stack(out, b, count, bytes);
+		}
+	}
+	write_mappings(out);
+	out.flush();
+	bool ok = out.ok;
+	return ::close(fd) == 0 && ok;
+}
+
+babb::heap_profile::statistics babb::heap_profile::stats() noexcept
+{
+	using namespace op_new_detail::heap_sampling;
+	statistics s;
+	s.sampled = sampled.load(std::memory_order_relaxed);
+	s.dropped = dropped.load(std::memory_order_relaxed);
+	return s;
+}
+
+#else
+
+bool babb::heap_profile::start(size_t) noexcept { return false; }
+void babb::heap_profile::stop() noexcept { }
+bool babb::heap_profile::write(const char*) noexcept { return false; }
+babb::heap_profile::statistics babb::heap_profile::stats() noexcept { return statistics(); }
+
+#endif
+
+#if defined(__linux__)
+
+BABB_NOINLINE void* babb::pages::allocate(size_t size) noexcept
+{
+	using namespace op_new_detail;
+	void* site = BABB_RETURN_ADDRESS();
+	if (size > SIZE_MAX - page_size() - sizeof(page_header)) return nullptr;
+	size_t length = round_up(size + sizeof(page_header), page_size());
+	page_header* h = static_cast<page_header*>(map_pages(length, size, site));
+	if (!h) return nullptr;
+	h->size = size;
+	h->length = length;
+	if (tracing_active()) trace_alloc(h + 1, size, 0, site);
+	return h + 1;
+}
+
+BABB_NOINLINE void* babb::pages::reallocate(void* p, size_t size) noexcept
+{
+	using namespace op_new_detail;
+	if (!p) return allocate(size);
+	void* site = BABB_RETURN_ADDRESS();
+	if (size > SIZE_MAX - page_size() - sizeof(page_header)) return nullptr;
+
+	page_header* h = page_header_of(p);
+	size_t old_size = h->size;
+	size_t length = round_up(size + sizeof(page_header), page_size());
+	size_t in_use = round_up(old_size + sizeof(page_header), page_size());
+
+	if (length > h->length) {
+		if (babb::this_thread.should_inject_random_failure(babb::paths::mapped)) {
+			if (tracing_active()) trace_inject(size, 0, babb::paths::mapped, site);
+			babb::this_thread.current().report_injection(size, site, babb::paths::mapped);
+			errno = ENOMEM;
+			return nullptr;
+		}
+		void* m = ::mremap(h, h->length, length, MREMAP_MAYMOVE);
+		if (m == MAP_FAILED) return nullptr;
+		h = static_cast<page_header*>(m);
+		h->length = length;
+	}
+	else if (length < in_use) {
+		::madvise(reinterpret_cast<char*>(h) + length, in_use - length, MADV_DONTNEED);
+	}
+
+	if (size < old_size) babb::released(old_size - size);
+	h->size = size;
+	if (tracing_active()) {
+		trace_free(p, old_size);
+		trace_alloc(h + 1, size, 0, site);
+	}
+	return h + 1;
+}
+
+void babb::pages::deallocate(void* p) noexcept
+{
+	using namespace op_new_detail;
+	if (!p) return;
+	page_header* h = page_header_of(p);
+	babb::released(h->size);
+	if (babb::run_length_policy::counts_frees) babb::this_thread.note_free(h->size);
+	if (tracing_active()) trace_free(p, h->size);
+	::munmap(h, h->length);
+}
+
+#else
+
+void* babb::pages::allocate(size_t size) noexcept
+{
+	if (babb::this_thread.should_inject_random_failure(babb::paths::mapped)) return nullptr;
+	op_new_detail::page_header* h = static_cast<op_new_detail::page_header*>(
+		size > SIZE_MAX - sizeof(op_new_detail::page_header) ? nullptr : ::malloc(size + sizeof(op_new_detail::page_header)));
+	if (!h) return nullptr;
+	h->size = h->length = size;
+	return h + 1;
+}
+
+void* babb::pages::reallocate(void* p, size_t size) noexcept
+{
+	if (!p) return allocate(size);
+	op_new_detail::page_header* h = op_new_detail::page_header_of(p);
+	if (size > h->length && babb::this_thread.should_inject_random_failure(babb::paths::mapped)) return nullptr;
+	if (size > SIZE_MAX - sizeof(op_new_detail::page_header)) return nullptr;
+	if (size < h->size) babb::released(h->size - size);
+	void* m = ::realloc(h, size + sizeof(op_new_detail::page_header));
+	if (!m) return nullptr;
+	h = static_cast<op_new_detail::page_header*>(m);
+	if (size > h->length) h->length = size;
+	h->size = size;
+	return h + 1;
+}
+
+void babb::pages::deallocate(void* p) noexcept
+{
+	if (!p) return;
+	op_new_detail::page_header* h = op_new_detail::page_header_of(p);
+	babb::released(h->size);
+	if (babb::run_length_policy::counts_frees) babb::this_thread.note_free(h->size);
+	::free(h);
+}
+
+#endif
+
+void *op_new_detail::new_impl(size_t size, void* site, bool nothrow)
 {
-    babb::this_thread.inject_random_failure();
     if (size == 0) size = 1;
 
+    // Allocating while unwinding from an injected failure (see babb::unwind_allocations)
+    if (babb::detail::in_flight.active && babb::detail::allocating_while_in_flight(site)
+        && !babb::this_thread.current().is_paused()) {
+        if (op_new_detail::tracing_active()) op_new_detail::trace_inject(size, 0, babb::paths::heap, site);
+        babb::this_thread.current().report_injection(size, site);
+        return op_new_detail::fail(site, false, nothrow);
+    }
+
+    // Slow some allocations down (see babb::state::set_delay_profile)
+    babb::this_thread.inject_random_delay(size);
+
+    // Large requests fail (if at all) inside mapped_malloc, like a real mmap
+    bool large = op_new_detail::is_large(size);
+    if (!large && babb::this_thread.should_inject_random_failure()) {
+        if (op_new_detail::tracing_active()) op_new_detail::trace_inject(size, 0, babb::paths::heap, site);
+        babb::this_thread.current().report_injection(size, site);
+        return op_new_detail::fail(site, true, nothrow);
+    }
+
+#if defined(BABB_HEAP_PROFILE)
+    bool sampled = (op_new_detail::heap_sampling::credit -= int64_t(size)) < 0
+        && op_new_detail::heap_sampling::overdrawn();
+#else
+    const bool sampled = false;
+#endif
+
     void* p;
-    while ((p = op_new_detail::malloc(size)) == 0)
+    bool injected = false;
+    while ((p = large ? op_new_detail::mapped_malloc(size, site, injected)
+                : sampled ? op_new_detail::sampled_malloc(size) : op_new_detail::heap_malloc(size)) == 0)
     {
      // If malloc fails and there is a new_handler, call it to try free up memory.
         std::new_handler nh = std::get_new_handler();
         if (!nh)
-            op_new_detail::throw_bad_alloc();
+            return op_new_detail::fail(site, injected, nothrow);
         nh();
     }
+    if (op_new_detail::tracing_active()) op_new_detail::trace_alloc(p, size, 0, site);
+    op_new_detail::probe_new(p, size, 0, site);
+#if defined(BABB_HEAP_PROFILE)
+    if (sampled) op_new_detail::heap_sampling::sample(p, size, site);
+#endif
     return p;
 }
 
-void* operator new(size_t size, const std::nothrow_t&) noexcept
+BABB_NOINLINE void* operator new(std::size_t size)
+{
+    return op_new_detail::new_impl(size, BABB_RETURN_ADDRESS());
+}
+
+BABB_NOINLINE void* operator new(size_t size, const std::nothrow_t&) noexcept
 {
     void* p = nullptr;
-    try { p = ::operator new(size); }
+    try { p = op_new_detail::new_impl(size, BABB_RETURN_ADDRESS(), true); }
     catch (...) {}
     return p;
 }
 
-void* operator new[](size_t size)
+BABB_NOINLINE void* operator new[](size_t size)
 {
-    return ::operator new(size);
+    return op_new_detail::new_impl(size, BABB_RETURN_ADDRESS());
 }
 
-void* operator new[](size_t size, const std::nothrow_t&) noexcept
+BABB_NOINLINE void* operator new[](size_t size, const std::nothrow_t&) noexcept
 {
     void* p = nullptr;
-    try { p = ::operator new[](size); }
+    try { p = op_new_detail::new_impl(size, BABB_RETURN_ADDRESS(), true); }
     catch (...) {}
     return p;
 }
 
 void operator delete(void* ptr) noexcept
 {
-    op_new_detail::free(ptr);
+    op_new_detail::block_free(ptr);
 }
 
 void operator delete(void* ptr, const std::nothrow_t&) noexcept
@@ -100,9 +1414,9 @@ void operator delete(void* ptr, const std::nothrow_t&) noexcept
     ::operator delete(ptr);
 }
 
-void operator delete(void* ptr, size_t) noexcept
+void operator delete(void* ptr, size_t size) noexcept
 {
-    ::operator delete(ptr);
+    op_new_detail::block_free(ptr, size);
 }
 
 void operator delete[] (void* ptr) noexcept
@@ -115,58 +1429,415 @@ void operator delete[] (void* ptr, const std::nothrow_t&) noexcept
     ::operator delete[](ptr);
 }
 
-void operator delete[] (void* ptr, size_t) noexcept
+void operator delete[] (void* ptr, size_t size) noexcept
 {
-    ::operator delete[](ptr);
+    op_new_detail::block_free(ptr, size);
 }
 
 
 
 #ifdef HAS_ALIGNED_ALLOCATIONS
 
-void* operator new(std::size_t size, std::align_val_t alignment)
+namespace op_new_detail {
+
+	//------------------------------------------------------------------------
+	//  Aligned allocations of up to slab_max_class bytes with alignment up to
+	//  a page are served from size classes carved out of 64 KiB slabs, with
+	//  per-thread free lists, instead of calling posix_memalign every time.
+	//
+	//  Slabs live in one reserved address range, so aligned delete tells
+	//  them apart from posix_memalign blocks with a single range check and
+	//  blocks need no header. A class of size S is usable for alignment A
+	//  when A divides S, because blocks sit at multiples of S in a slab.
+	//------------------------------------------------------------------------
+
+#if !defined(_WIN32) && SIZE_MAX > 0xFFFFFFFFu
+#define BABB_SLAB_CACHE
+
+	const size_t slab_bytes     = size_t(64) << 10;
+	const size_t arena_bytes    = size_t(16) << 30;
+	const size_t arena_slabs    = arena_bytes / slab_bytes;
+	const size_t slab_max_align = 4096;
+
+	const size_t slab_classes[] = {
+		32, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536,
+		2048, 3072, 4096, 6144, 8192, 12288, 16384
+	};
+	const int num_slab_classes = sizeof(slab_classes) / sizeof(slab_classes[0]);
+	const size_t slab_max_class = slab_classes[num_slab_classes - 1];
+
+	struct free_block { free_block* next; };
+
+	char* arena_begin = nullptr;
+	char* arena_end   = nullptr;
+	std::atomic<size_t> arena_used{0};
+	unsigned char slab_class_of[arena_slabs];	// indexed by slab number
+
+	bool in_arena(void* p)
+	{
+		// unsigned wraparound makes this one compare; false until reserved
+		return uintptr_t(p) - uintptr_t(arena_begin) < uintptr_t(arena_end) - uintptr_t(arena_begin);
+	}
+
+	bool reserve_arena()
+	{
+		static bool reserved = [] {
+			// PROT_NONE reserves address space only; slabs are committed one by one
+			void* m = ::mmap(nullptr, arena_bytes + slab_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (m == MAP_FAILED) return false;
+			arena_begin = reinterpret_cast<char*>(round_up(reinterpret_cast<size_t>(m), slab_bytes));
+			arena_end = arena_begin + arena_bytes;
+			return true;
+		}();
+		return reserved;
+	}
+
+	int class_for(size_t size, size_t alignment)
+	{
+		if (size > slab_max_class || alignment > slab_max_align) return -1;
+		for (int c = 0; c < num_slab_classes; ++c)
+			if (slab_classes[c] >= size && slab_classes[c] % alignment == 0)
+				return c;
+		return -1;
+	}
+
+	// Free blocks that threads spilled or left behind at exit, for other
+	// threads to reuse, and slabs the scavenger has given back to the OS,
+	// for any class
+	struct depot_ {
+		std::mutex lock;
+		free_block* lists[num_slab_classes] = {};
+		uint32_t released_slabs[arena_slabs];
+		size_t released = 0;
+	} depot;
+
+	// Puts the blocks first..last, linked in that order, in the depot
+	void give_to_depot(int c, free_block* first, free_block* last)
+	{
+		std::lock_guard<std::mutex> hold(depot.lock);
+		last->next = depot.lists[c];
+		depot.lists[c] = first;
+	}
+
+	// A thread's free lists, with the length of each. A thread that frees
+	// more than it allocates (a consumer fed by others) keeps no more than
+	// cache_limit bytes of a class, and spills a slab's worth past that.
+	struct slab_cache {
+		free_block* lists[num_slab_classes];
+		uint32_t counts[num_slab_classes];
+	};
+
+	const size_t cache_limit = 2 * slab_bytes;
+
+	BABB_TLS slab_cache* cache = nullptr;
+	BABB_TLS bool cache_exited = false;
+
+	struct cache_owner {
+		slab_cache own = {};
+		~cache_owner()
+		{
+			// frees later in thread exit must not find the lists (see slab_free)
+			cache = nullptr;
+			cache_exited = true;
+			for (int c = 0; c < num_slab_classes; ++c) {
+				free_block* last = own.lists[c];
+				if (!last) continue;
+				while (last->next) last = last->next;
+				give_to_depot(c, own.lists[c], last);
+			}
+		}
+	};
+	thread_local cache_owner exiting_cache;
+
+	// Once per thread; nullptr once the thread's cache has been handed back
+	slab_cache* adopt_cache()
+	{
+		if (cache_exited) return nullptr;
+		return cache = &exiting_cache.own;
+	}
+
+	void spill(slab_cache& s, int c)
+	{
+		uint32_t n = uint32_t(slab_bytes / slab_classes[c]);
+		free_block* first = s.lists[c];
+		free_block* last = first;
+		for (uint32_t i = 1; i < n; ++i) last = last->next;
+		s.lists[c] = last->next;
+		s.counts[c] -= n;
+		give_to_depot(c, first, last);
+	}
+
+	bool refill(slab_cache& s, int c)
+	{
+		size_t offset = SIZE_MAX;
+		{
+			std::lock_guard<std::mutex> hold(depot.lock);
+			if (free_block* first = depot.lists[c]) {
+				// a slab's worth at most, so a refill stays within the limit
+				uint32_t n = 1, most = uint32_t(slab_bytes / slab_classes[c]);
+				free_block* last = first;
+				for (; n < most && last->next; ++n) last = last->next;
+				depot.lists[c] = last->next;
+				last->next = nullptr;
+				s.lists[c] = first;
+				s.counts[c] = n;
+				return true;
+			}
+			if (depot.released)		// still mapped read-write, just not resident
+				offset = depot.released_slabs[--depot.released] * slab_bytes;
+		}
+
+		if (offset == SIZE_MAX) {
+			if (!reserve_arena()) return false;
+			offset = arena_used.fetch_add(slab_bytes, std::memory_order_relaxed);
+			if (offset >= arena_bytes) return false;
+			if (::mprotect(arena_begin + offset, slab_bytes, PROT_READ | PROT_WRITE) != 0) return false;
+		}
+		char* slab = arena_begin + offset;
+		slab_class_of[offset / slab_bytes] = static_cast<unsigned char>(c);
+
+		size_t size = slab_classes[c];
+		free_block* list = nullptr;
+		for (size_t at = slab_bytes / size * size; at >= size; at -= size) {
+			free_block* b = reinterpret_cast<free_block*>(slab + at - size);
+			b->next = list;
+			list = b;
+		}
+		s.lists[c] = list;
+		s.counts[c] = uint32_t(slab_bytes / size);
+		return true;
+	}
+
+	// After its cache is handed back, a thread allocates from the depot
+	// directly, and falls back to aligned_malloc when that is empty
+	void *slab_malloc(int c)
+	{
+		slab_cache* s = cache;
+		if (!s && !(s = adopt_cache())) {
+			std::lock_guard<std::mutex> hold(depot.lock);
+			free_block* b = depot.lists[c];
+			if (b) depot.lists[c] = b->next;
+			return b;
+		}
+		if (!s->lists[c] && !refill(*s, c)) return nullptr;
+		free_block* b = s->lists[c];
+		s->lists[c] = b->next;
+		--s->counts[c];
+		return b;
+	}
+
+	void slab_free(void* p)
+	{
+		int c = slab_class_of[size_t(static_cast<char*>(p) - arena_begin) / slab_bytes];
+		free_block* b = static_cast<free_block*>(p);
+		slab_cache* s = cache;
+		if (!s && !(s = adopt_cache())) { give_to_depot(c, b, b); return; }
+		b->next = s->lists[c];
+		s->lists[c] = b;
+		if (++s->counts[c] * slab_classes[c] > cache_limit) spill(*s, c);
+	}
+
+	void *aligned_new_malloc(size_t size, size_t alignment)
+	{
+		int c = class_for(size, alignment);
+		if (c >= 0)
+			if (void* p = slab_malloc(c))
+				return p;
+		return aligned_malloc(size, alignment);
+	}
+
+	// Usable size of a block, or 0 where the system allocator does not say
+	size_t aligned_new_size(void* p)
+	{
+		return in_arena(p) ? slab_classes[slab_class_of[size_t(static_cast<char*>(p) - arena_begin) / slab_bytes]] : 0;
+	}
+
+	void aligned_new_free(void* p)
+	{
+		if (in_arena(p))
+			slab_free(p);
+		else
+			aligned_free(p);
+	}
+
+	//------------------------------------------------------------------------
+	//  Scavenging (see babb::scavenger). A pass swaps the depot's lists out
+	//  under a try-lock, counts the free blocks of each slab, drops the
+	//  blocks of (up to 64) slabs that are entirely free, and splices the
+	//  rest back.
+	//------------------------------------------------------------------------
+
+	namespace scavenging {
+
+		const uint16_t slab_released = 0xFFFF;
+		uint16_t free_blocks[arena_slabs];		// per slab, during a pass only
+
+		std::atomic<uint64_t> passes{0}, skipped{0}, slabs_released{0}, bytes_returned{0};
+
+		// Whole passes are serialized: free_blocks is shared scratch, and two
+		// passes must never see blocks of the same slab
+		std::mutex pass_lock;
+
+		size_t slab_of(free_block* b) { return size_t(reinterpret_cast<char*>(b) - arena_begin) / slab_bytes; }
+
+		void pass(size_t keep_bytes)
+		{
+			std::unique_lock<std::mutex> running(pass_lock, std::try_to_lock);
+			if (!running) { skipped.fetch_add(1, std::memory_order_relaxed); return; }
+
+			free_block* taken[num_slab_classes];
+			{
+				std::unique_lock<std::mutex> hold(depot.lock, std::try_to_lock);
+				if (!hold) { skipped.fetch_add(1, std::memory_order_relaxed); return; }
+				for (int c = 0; c < num_slab_classes; ++c) {
+					taken[c] = depot.lists[c];
+					depot.lists[c] = nullptr;
+				}
+			}
+			passes.fetch_add(1, std::memory_order_relaxed);
+
+			size_t idle = 0;
+			for (int c = 0; c < num_slab_classes; ++c)
+				for (free_block* b = taken[c]; b; b = b->next) {
+					++free_blocks[slab_of(b)];
+					idle += slab_classes[c];
+				}
+
+			// Keep the blocks of partly used slabs, and of enough free ones to stay at keep_bytes
+			free_block* kept[num_slab_classes];
+			free_block* tails[num_slab_classes];
+			uint32_t released[64];
+			size_t n_released = 0;
+			for (int c = 0; c < num_slab_classes; ++c) {
+				size_t per_slab = slab_bytes / slab_classes[c];
+				kept[c] = tails[c] = nullptr;
+				for (free_block* b = taken[c], *next; b; b = next) {
+					next = b->next;
+					size_t slab = slab_of(b);
+					if (free_blocks[slab] == per_slab && idle >= keep_bytes + slab_bytes && n_released < 64) {
+						free_blocks[slab] = slab_released;
+						released[n_released++] = uint32_t(slab);
+						idle -= slab_bytes;
+					}
+					if (free_blocks[slab] == slab_released) continue;
+					free_blocks[slab] = 0;
+					b->next = kept[c];
+					kept[c] = b;
+					if (!tails[c]) tails[c] = b;
+				}
+			}
+
+			for (size_t i = 0; i < n_released; ++i) {
+				::madvise(arena_begin + released[i] * slab_bytes, slab_bytes, MADV_DONTNEED);
+				free_blocks[released[i]] = 0;
+			}
+			slabs_released.fetch_add(n_released, std::memory_order_relaxed);
+			bytes_returned.fetch_add(n_released * slab_bytes, std::memory_order_relaxed);
+
+			// Hand back; threads may have spilled or exited meanwhile
+			for (;;) {
+				std::unique_lock<std::mutex> hold(depot.lock, std::try_to_lock);
+				if (!hold) { std::this_thread::yield(); continue; }
+				for (int c = 0; c < num_slab_classes; ++c) {
+					if (!kept[c]) continue;
+					tails[c]->next = depot.lists[c];
+					depot.lists[c] = kept[c];
+				}
+				for (size_t i = 0; i < n_released; ++i)
+					depot.released_slabs[depot.released++] = released[i];
+				return;
+			}
+		}
+
+		std::mutex control;
+		std::condition_variable wake;
+		std::thread worker;
+		bool stopping = false;
+
+		// A running std::thread must not be destroyed, so stop it at exit
+		struct stop_at_exit { ~stop_at_exit() { babb::scavenger::stop(); } } stopper;
+
+	}
+
+#else
+
+	void *aligned_new_malloc(size_t size, size_t alignment) { return aligned_malloc(size, alignment); }
+	void  aligned_new_free  (void* p)                       { aligned_free(p); }
+	size_t aligned_new_size (void*)                         { return 0; }
+
+#endif
+
+	void *aligned_new_impl(size_t size, std::align_val_t alignment, void* site, bool nothrow = false);
+
+}
+
+void *op_new_detail::aligned_new_impl(size_t size, std::align_val_t alignment, void* site, bool nothrow)
 {
-    babb::this_thread.inject_random_failure();
+    if (babb::detail::in_flight.active && babb::detail::allocating_while_in_flight(site)
+        && !babb::this_thread.current().is_paused()) {
+        if (op_new_detail::tracing_active()) op_new_detail::trace_inject(size, static_cast<size_t>(alignment), babb::paths::heap, site);
+        babb::this_thread.current().report_injection(size, site);
+        return op_new_detail::fail(site, false, nothrow);
+    }
+    babb::this_thread.inject_random_delay(size);
+    if (babb::this_thread.should_inject_random_failure()) {
+        if (op_new_detail::tracing_active()) op_new_detail::trace_inject(size, static_cast<size_t>(alignment), babb::paths::heap, site);
+        babb::this_thread.current().report_injection(size, site);
+        return op_new_detail::fail(site, true, nothrow);
+    }
     if (size == 0) size = 1;
     if (static_cast<size_t>(alignment) < sizeof(void*))
       alignment = std::align_val_t(sizeof(void*));
 
     void* p;
-    while ((p = op_new_detail::aligned_malloc(size, static_cast<size_t>(alignment))) == nullptr)
+    while ((p = op_new_detail::aligned_new_malloc(size, static_cast<size_t>(alignment))) == nullptr)
     {
      // If aligned_malloc fails and there is a new_handler, call it to try free up memory.
         std::new_handler nh = std::get_new_handler();
         if (!nh)
-            op_new_detail::throw_bad_alloc();
+            return op_new_detail::fail(site, false, nothrow);
         nh();
     }
+    if (op_new_detail::tracing_active()) op_new_detail::trace_alloc(p, size, static_cast<size_t>(alignment), site);
+    op_new_detail::probe_new(p, size, static_cast<size_t>(alignment), site);
     return p;
 }
 
-void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+BABB_NOINLINE void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return op_new_detail::aligned_new_impl(size, alignment, BABB_RETURN_ADDRESS());
+}
+
+BABB_NOINLINE void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
 {
     void* p = nullptr;
-    try { p = ::operator new(size, alignment); }
+    try { p = op_new_detail::aligned_new_impl(size, alignment, BABB_RETURN_ADDRESS(), true); }
     catch (...) {}
     return p;
 }
 
-void* operator new[](size_t size, std::align_val_t alignment)
+BABB_NOINLINE void* operator new[](size_t size, std::align_val_t alignment)
 {
-    return ::operator new(size, alignment);
+    return op_new_detail::aligned_new_impl(size, alignment, BABB_RETURN_ADDRESS());
 }
 
-void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+BABB_NOINLINE void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
 {
     void* p = nullptr;
-    try { p = ::operator new[](size, alignment); }
+    try { p = op_new_detail::aligned_new_impl(size, alignment, BABB_RETURN_ADDRESS(), true); }
     catch (...) {}
     return p;
 }
 
 void operator delete(void* ptr, std::align_val_t) noexcept
 {
-    op_new_detail::free(ptr);
+    if (!ptr) return;
+    size_t size = op_new_detail::aligned_new_size(ptr);
+    babb::released(size);
+    if (babb::run_length_policy::counts_frees) babb::this_thread.note_free(size);
+    if (op_new_detail::tracing_active()) op_new_detail::trace_free(ptr, size);
+    op_new_detail::probe_delete(ptr, size);
+    op_new_detail::aligned_new_free(ptr);
 }
 
 void operator delete(void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept
@@ -196,3 +1867,62 @@ void operator delete[] (void* ptr, size_t, std::align_val_t alignment) noexcept
 
 #endif // !HAS_ALIGNED_ALLOCATIONS
 
+#ifdef BABB_SLAB_CACHE
+
+bool babb::scavenger::start(std::chrono::milliseconds interval, size_t keep_bytes)
+{
+	using namespace op_new_detail::scavenging;
+	stop();
+	std::lock_guard<std::mutex> hold(control);
+	stopping = false;
+	babb::pause_guard bookkeeping(babb::this_thread);
+	worker = std::thread([=] {
+		babb::this_thread.pause(true);		// the scavenger's own allocations must not fail
+		std::unique_lock<std::mutex> lock(control);
+		while (!wake.wait_for(lock, interval, [] { return stopping; })) {
+			lock.unlock();
+			pass(keep_bytes);
+			lock.lock();
+		}
+	});
+	return true;
+}
+
+void babb::scavenger::stop() noexcept
+{
+	using namespace op_new_detail::scavenging;
+	std::thread finished;
+	{
+		std::lock_guard<std::mutex> hold(control);
+		stopping = true;
+		finished.swap(worker);
+	}
+	wake.notify_all();
+	if (finished.joinable()) finished.join();
+}
+
+void babb::scavenger::scavenge(size_t keep_bytes) noexcept
+{
+	op_new_detail::scavenging::pass(keep_bytes);
+}
+
+babb::scavenger::statistics babb::scavenger::stats() noexcept
+{
+	using namespace op_new_detail::scavenging;
+	statistics s;
+	s.passes = passes.load(std::memory_order_relaxed);
+	s.skipped = skipped.load(std::memory_order_relaxed);
+	s.slabs_released = slabs_released.load(std::memory_order_relaxed);
+	s.bytes_returned = bytes_returned.load(std::memory_order_relaxed);
+	return s;
+}
+
+#else
+
+bool babb::scavenger::start(std::chrono::milliseconds, size_t) { return false; }
+void babb::scavenger::stop() noexcept { }
+void babb::scavenger::scavenge(size_t) noexcept { }
+babb::scavenger::statistics babb::scavenger::stats() noexcept { return statistics(); }
+
+#endif
+
@@ -0,0 +1,151 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+//----------------------------------------------------------------------------
+//  Test of run-time GOT patching. This cannot live in test.cpp, which links
+//  new_replacements.cpp: build it with babb_patch.cpp instead, e.g.:
+//      g++ -O2 -std=c++11 patch_test.cpp babb.cpp babb_patch.cpp -ldl
+//  Define PATCH_TEST_PLUGIN as the path of patch_test_plugin.so to also test
+//  patching objects loaded later.
+//----------------------------------------------------------------------------
+
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <new>
+using namespace std;
+
+#include "babb.h"
+#include "babb_patch.h"
+
+#ifdef PATCH_TEST_PLUGIN
+#include <dlfcn.h>
+#endif
+
+// Allocations go through here so the compiler cannot elide them
+void* volatile keep;
+
+struct counts { int malloc_failures = 0, new_failures = 0; };
+
+counts allocate(int n) {
+	counts c;
+	for (int i = 0; i < n; ++i) {
+		if (!(keep = malloc(16))) ++c.malloc_failures;
+		else free(keep);
+		try { keep = new int; delete static_cast<int*>(keep); }
+		catch (const bad_alloc &) { ++c.new_failures; }
+	}
+	return c;
+}
+
+#ifdef PATCH_TEST_PLUGIN
+
+// Failures among n allocations by a freshly loaded plugin
+int plugin_failures(int n) {
+	void* plugin = dlopen(PATCH_TEST_PLUGIN, RTLD_NOW | RTLD_LOCAL);
+	assert(plugin && "the plugin loads");
+	auto allocate = reinterpret_cast<void*(*)(size_t)>(dlsym(plugin, "plugin_malloc"));
+	auto release = reinterpret_cast<void(*)(void*)>(dlsym(plugin, "plugin_free"));
+	int failures = 0;
+	for (int i = 0; i < n; ++i) {
+		if (!(keep = allocate(16))) ++failures;
+		else release(keep);
+	}
+	dlclose(plugin);
+	return failures;
+}
+
+void plugin_test() {
+	cout << "\n===== Testing patching of late-loaded objects:\n";
+
+	babb::got::patch();
+	size_t objects = babb::got::patched_objects();
+	int failures = plugin_failures(1000);
+	assert(failures > 0 && "the plugin was patched when it was loaded");
+	assert(babb::got::patched_objects() == objects && "and forgotten when it was unloaded");
+	babb::got::depatch();
+
+	babb::got::exclude("patch_test_plugin");
+	babb::got::patch();
+	assert(plugin_failures(1000) == 0 && "excluded objects are not patched");
+	babb::got::depatch();
+	babb::got::clear_rules();
+
+	// Unloaded and loaded again while depatched, maybe at the same address
+	void* plugin = dlopen(PATCH_TEST_PLUGIN, RTLD_NOW | RTLD_LOCAL);
+	babb::got::patch();
+	babb::got::depatch();
+	dlclose(plugin);
+	plugin = dlopen(PATCH_TEST_PLUGIN, RTLD_NOW | RTLD_LOCAL);
+	babb::got::patch();
+	assert(plugin_failures(1000) > 0 && "the reloaded plugin is patched");
+	babb::got::depatch();
+	dlclose(plugin);
+
+	cout << failures << " plugin malloc failures while patched\nOK\n";
+}
+
+#endif
+
+int main() {
+	cout << "===== Testing GOT patching:\n";
+	babb::this_thread.set_failure_profile(10, 1);
+
+	counts before = allocate(1000);
+	assert(before.malloc_failures == 0 && before.new_failures == 0 && "not patched yet");
+
+	if (!babb::got::patch()) {
+		cout << "not supported on this platform\n";
+		return 0;
+	}
+	assert(babb::got::patched() && babb::got::patched_slots() > 0);
+	counts during = allocate(1000);
+	babb::got::depatch();
+	assert(during.malloc_failures > 0 && "malloc calls are redirected");
+	assert(during.new_failures > 0 && "operator new calls are redirected");
+
+	assert(!babb::got::patched() && babb::got::patched_slots() == 0);
+	counts after = allocate(1000);
+	assert(after.malloc_failures == 0 && after.new_failures == 0 && "depatch restores the originals");
+
+	cout << during.malloc_failures << " malloc and " << during.new_failures
+		<< " operator new failures while patched\nOK\n";
+
+	cout << "\n===== Testing free-driven recovery through patched free:\n";
+	{
+	babb::state_guard save(babb::this_thread);
+	void* blocks[4];
+	for (auto& b : blocks) b = malloc(1024);
+	babb::got::patch();
+	babb::this_thread.set_failure_profile(1, 1);
+	babb::this_thread.set_recovery(4096);
+	assert(babb::this_thread.should_inject_random_failure() && "a run lasts until memory is freed");
+	babb::this_thread.set_failure_profile(numeric_limits<int>::max(), 1);
+	for (int i = 0; i < 3; ++i) free(blocks[i]);
+	assert(babb::this_thread.should_inject_random_failure() && "3 KiB freed is not enough");
+	free(blocks[3]);
+	assert(!babb::this_thread.should_inject_random_failure() && "4 KiB freed ends the run");
+	babb::got::depatch();
+	}
+	cout << "OK\n";
+
+#ifdef PATCH_TEST_PLUGIN
+	plugin_test();
+#endif
+}
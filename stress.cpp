@@ -0,0 +1,366 @@
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2019 Herb Sutter and Marshall Clow. All rights reserved.
+//
+// This code is licensed under the MIT License (MIT).
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+
+//----------------------------------------------------------------------------
+//
+//  Multi-threaded allocation stress harness
+//
+//  Producer threads allocate blocks (and build short-lived containers) and
+//  hand the blocks to consumer threads, which free them, so most frees are
+//  cross-thread. Each configuration is run twice, once with injection paused
+//  and once with the requested failure profile, and reports throughput,
+//  allocation latency percentiles and RSS for both.
+//
+//  Build with optimizations together with babb.cpp and new_replacements.cpp
+//  (or link the babb library, see CMakeLists.txt), e.g.:
+//      g++ -O2 -std=c++11 -pthread stress.cpp babb.cpp new_replacements.cpp
+//
+//  Options (all optional):
+//      --producers=N       allocating threads (default 4)
+//      --consumers=N       freeing threads (default 4)
+//      --ops=N             allocations per producer (default 1000000)
+//      --containers=N      build a small map/vector/string every N
+//                          allocations, 0 for none (default 16)
+//      --fail-once-per=N   failure profile for the injected run
+//      --run-length=N          (defaults: 10000 and 5)
+//      --delay-once-per=N  also delay about one allocation in N in the
+//      --delay-us=N            injected run, by N microseconds on average,
+//                              exponentially distributed (defaults: 0, for
+//                              no delays, and 10; see set_delay_profile)
+//      --histogram=FILE    size distribution, one "size weight" pair per
+//                          line, '#' starts a comment; by default a mix of
+//                          small sizes with occasional large blocks
+//      --unwind-costs=1    report throw-to-catch latency per throw site and
+//                          allocations while unwinding per allocation
+//                          site, for the injected run (see
+//                          babb::unwind_costs and unwind_allocations)
+//      --heap-profile=FILE write a sampled heap profile of the injected run
+//                          to FILE, for pprof (see babb::heap_profile)
+//
+//----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "babb.h"
+#include "babb_log.h"
+
+struct options {
+    int producers = 4;
+    int consumers = 4;
+    long ops = 1000000;
+    int containers = 16;
+    int fail_once_per = 10000;
+    int run_length = 5;
+    int delay_once_per = 0;
+    int delay_us = 10;
+    bool unwind_costs = false;
+    string heap_profile;
+    vector<size_t> sizes;
+    vector<double> weights;
+};
+
+
+//----------------------------------------------------------------------------
+//  Hand-off queue from producers to one consumer. Producers push whole
+//  batches so the lock is taken once per batch, not once per block.
+//----------------------------------------------------------------------------
+
+const int batch_size = 64;
+
+struct batch {
+    void* blocks[batch_size];
+    int count = 0;
+};
+
+class handoff {
+    mutex lock;
+    condition_variable ready;
+    vector<batch> queue;        // preallocated, used as a ring
+    size_t head = 0, tail = 0;
+    bool done = false;
+
+public:
+    explicit handoff(size_t capacity) : queue(capacity) { }
+
+    void push(const batch& b) {
+        unique_lock<mutex> hold(lock);
+        ready.wait(hold, [&] { return tail - head < queue.size(); });
+        queue[tail++ % queue.size()] = b;
+        ready.notify_all();
+    }
+
+    bool pop(batch& b) {
+        unique_lock<mutex> hold(lock);
+        ready.wait(hold, [&] { return head != tail || done; });
+        if (head == tail) return false;
+        b = queue[head++ % queue.size()];
+        ready.notify_all();
+        return true;
+    }
+
+    void finish() {
+        lock_guard<mutex> hold(lock);
+        done = true;
+        ready.notify_all();
+    }
+};
+
+
+//----------------------------------------------------------------------------
+//  Producer: allocate, time each allocation, pass the blocks on
+//----------------------------------------------------------------------------
+
+struct producer_result {
+    vector<uint32_t> latencies;     // ns per successful or failed allocation
+    long failures = 0;
+    long container_failures = 0;
+};
+
+void build_containers(int seed) {
+    map<int, string> m;
+    vector<string> v;
+    for (int i = 0; i < 8; ++i) {
+        m[seed + i] = "value number " + to_string(seed + i) + " with some padding";
+        v.push_back(m[seed + i]);
+    }
+    v.insert(v.begin(), v.back());
+}
+
+void produce(const options& opt, bool inject, int id, vector<handoff*>& to, producer_result& result) {
+    babb::this_thread.pause(true);      // setup must not fail
+    result.latencies.reserve(size_t(opt.ops));
+    mt19937 random(id);
+    discrete_distribution<int> pick(opt.weights.begin(), opt.weights.end());
+    batch b;
+    int next_consumer = id;
+    babb::this_thread.pause(!inject);
+
+    for (long i = 0; i < opt.ops; ++i) {
+        size_t size = opt.sizes[pick(random)];
+
+        auto start = chrono::steady_clock::now();
+        void* p = nullptr;
+        try { p = ::operator new(size); }
+        catch (const bad_alloc&) { babb::unwind_costs::caught(); ++result.failures; }
+        auto stop = chrono::steady_clock::now();
+        result.latencies.push_back(uint32_t(chrono::duration_cast<chrono::nanoseconds>(stop - start).count()));
+
+        if (p) {
+            memset(p, 0, min(size, size_t(64)));
+            b.blocks[b.count++] = p;
+            if (b.count == batch_size) {
+                to[next_consumer++ % to.size()]->push(b);
+                b.count = 0;
+            }
+        }
+
+        if (opt.containers && i % opt.containers == 0) {
+            try { build_containers(int(i)); }
+            catch (const bad_alloc&) { babb::unwind_costs::caught(); ++result.container_failures; }
+        }
+    }
+    if (b.count) to[next_consumer % to.size()]->push(b);
+
+    babb::this_thread.pause(false);
+}
+
+void consume(handoff& from) {
+    batch b;
+    while (from.pop(b))
+        for (int i = 0; i < b.count; ++i)
+            ::operator delete(b.blocks[i]);
+}
+
+
+//----------------------------------------------------------------------------
+//  Reporting
+//----------------------------------------------------------------------------
+
+double resident_mib() {
+#if defined(__linux__)
+    long pages = 0, resident = 0;
+    if (FILE* f = fopen("/proc/self/statm", "r")) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return double(resident) * sysconf(_SC_PAGESIZE) / (1 << 20);
+#elif !defined(_WIN32)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return double(usage.ru_maxrss) / 1024;      // peak only, in KiB on most systems
+#else
+    return 0;
+#endif
+}
+
+void run(const options& opt, bool inject) {
+    vector<producer_result> results(opt.producers);
+    vector<handoff*> queues;
+    for (int c = 0; c < opt.consumers; ++c)
+        queues.push_back(new handoff(1024));
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> consumers, producers;
+    for (int c = 0; c < opt.consumers; ++c)
+        consumers.emplace_back(consume, ref(*queues[c]));
+    for (int p = 0; p < opt.producers; ++p)
+        producers.emplace_back(produce, cref(opt), inject, p, ref(queues), ref(results[p]));
+    for (auto& t : producers) t.join();
+    double rss = resident_mib();
+    for (auto q : queues) q->finish();
+    for (auto& t : consumers) t.join();
+    auto stop = chrono::steady_clock::now();
+
+    vector<uint32_t> all;
+    long failures = 0, container_failures = 0;
+    for (auto& r : results) {
+        all.insert(all.end(), r.latencies.begin(), r.latencies.end());
+        failures += r.failures;
+        container_failures += r.container_failures;
+    }
+    sort(all.begin(), all.end());
+    auto percentile = [&](double q) { return all.empty() ? 0u : all[min(all.size() - 1, size_t(q * all.size()))]; };
+    double seconds = chrono::duration<double>(stop - start).count();
+
+    printf("%-9s %12.0f %8u %8u %8u %10ld %10ld %9.1f\n",
+        inject ? "injected" : "baseline",
+        all.size() / seconds,
+        percentile(.50), percentile(.99), percentile(.999),
+        failures, container_failures, rss);
+
+    for (auto q : queues) delete q;
+}
+
+
+//----------------------------------------------------------------------------
+//  Options
+//----------------------------------------------------------------------------
+
+bool read_histogram(const char* path, options& opt) {
+    ifstream in(path);
+    if (!in) return false;
+    string line;
+    while (getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        istringstream fields(line);
+        size_t size;
+        double weight;
+        if (fields >> size >> weight && size > 0 && weight > 0) {
+            opt.sizes.push_back(size);
+            opt.weights.push_back(weight);
+        }
+    }
+    return !opt.sizes.empty();
+}
+
+void default_histogram(options& opt) {
+    const struct { size_t size; double weight; } mix[] = {
+        { 16, 20 }, { 32, 25 }, { 48, 10 }, { 64, 15 }, { 128, 10 }, { 256, 8 },
+        { 512, 5 }, { 1024, 3 }, { 4096, 2 }, { 65536, .5 }, { 2 << 20, .01 }
+    };
+    for (auto& m : mix) {
+        opt.sizes.push_back(m.size);
+        opt.weights.push_back(m.weight);
+    }
+}
+
+bool parse(int argc, char* argv[], options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* eq = strchr(arg, '=');
+        if (!eq) return false;
+        string key(arg, eq);
+        const char* value = eq + 1;
+        if      (key == "--producers")     opt.producers = atoi(value);
+        else if (key == "--consumers")     opt.consumers = atoi(value);
+        else if (key == "--ops")           opt.ops = atol(value);
+        else if (key == "--containers")    opt.containers = atoi(value);
+        else if (key == "--fail-once-per") opt.fail_once_per = atoi(value);
+        else if (key == "--run-length")    opt.run_length = atoi(value);
+        else if (key == "--delay-once-per") opt.delay_once_per = atoi(value);
+        else if (key == "--delay-us")      opt.delay_us = atoi(value);
+        else if (key == "--unwind-costs")  opt.unwind_costs = atoi(value) != 0;
+        else if (key == "--heap-profile")  opt.heap_profile = value;
+        else if (key == "--histogram") {
+            if (!read_histogram(value, opt)) {
+                fprintf(stderr, "cannot read a size histogram from %s\n", value);
+                return false;
+            }
+        }
+        else return false;
+    }
+    if (opt.sizes.empty()) default_histogram(opt);
+    return opt.producers > 0 && opt.consumers > 0 && opt.ops > 0 && opt.containers >= 0
+        && opt.fail_once_per > 0 && opt.run_length > 0 && opt.delay_once_per >= 0 && opt.delay_us >= 0;
+}
+
+
+int main(int argc, char* argv[]) {
+    babb::pause_guard setup(babb::this_thread);
+
+    options opt;
+    if (!parse(argc, argv, opt)) {
+        fprintf(stderr, "usage: %s [--producers=N] [--consumers=N] [--ops=N] [--containers=N]\n"
+                        "       [--fail-once-per=N] [--run-length=N] [--delay-once-per=N] [--delay-us=N]\n"
+                        "       [--histogram=FILE] [--unwind-costs=1] [--heap-profile=FILE]\n", argv[0]);
+        return 1;
+    }
+    babb::shared.set_failure_profile(opt.fail_once_per, opt.run_length);
+    babb::shared.set_delay_profile(opt.delay_once_per, chrono::microseconds(opt.delay_us), 1,
+                                   babb::delays::spin, babb::delays::exponential);
+
+    printf("%d producers, %d consumers, %ld allocations each, profile %d/%d\n\n",
+        opt.producers, opt.consumers, opt.ops, opt.fail_once_per, opt.run_length);
+    printf("%-9s %12s %8s %8s %8s %10s %10s %9s\n",
+        "run", "allocs/s", "p50 ns", "p99 ns", "p999 ns", "failures", "cont.fail", "RSS MiB");
+    run(opt, false);
+    babb::unwind_costs::enable(opt.unwind_costs);
+    if (!opt.heap_profile.empty()) babb::heap_profile::start();
+    run(opt, true);
+    babb::heap_profile::stop();
+    babb::unwind_costs::enable(false);
+
+    if (!opt.heap_profile.empty() && !babb::heap_profile::write(opt.heap_profile.c_str()))
+        fprintf(stderr, "cannot write a heap profile to %s\n", opt.heap_profile.c_str());
+
+    if (opt.unwind_costs) {
+        printf("\n");
+        babb::unwind_costs::report(stdout);
+        babb::unwind_allocations::report(stdout);
+    }
+}
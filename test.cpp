@@ -21,9 +21,15 @@
 //----------------------------------------------------------------------------
 
 #include <iostream>
+#include <chrono>
+#include <thread>
 using namespace std;
 
 #include "babb.h"
+#include "babb_log.h"
+
+// Allocations go through here so the compiler cannot elide them
+void* volatile keep;
 
 void smoke_test() {
 	constexpr int N = 1000;
@@ -31,12 +37,13 @@ void smoke_test() {
 
 	int total = 0;
 
+	babb::state_guard smoke(babb::this_thread);
 	babb::this_thread.set_failure_profile(10, 10);
 
 	cout << "===== Testing bad_alloc:\n";
     int i = 0;
 	while (++i < 200) {
-		try { (void) new int; cout << '.'; }
+		try { keep = new int; cout << '.'; }
 		catch (const bad_alloc &) { cout << '!'; ++total; }
 		catch (...) { assert(!"other exception was thrown"); }
 	}
@@ -44,12 +51,12 @@ void smoke_test() {
     babb::state_guard save(babb::this_thread);
     babb::this_thread.pause(true);
 	while (++i < 700) {
-		try { (void) new int; cout << '.'; }
+		try { keep = new int; cout << '.'; }
 		catch (...) { assert(!"no exception should be thrown, injection is paused"); }
 	}
     }
 	while (++i < N) {
-		try { (void) new int; cout << '.'; }
+		try { keep = new int; cout << '.'; }
 		catch (const bad_alloc &) { cout << '!'; ++total; }
 		catch (...) { assert(!"other exception was thrown"); }
 	}
@@ -82,6 +89,695 @@ void smoke_test() {
 }
 
 
+void context_test() {
+	cout << "\n===== Testing context install/restore:\n";
+
+	babb::context task;
+	task.pause(true);
+	{
+	babb::context_scope in_task(task);
+	for (int i = 0; i < 1000; ++i)
+		assert(!babb::this_thread.should_inject_random_failure() && "task context is paused");
+	}
+	assert(&babb::this_thread.current() != &task && "thread context restored");
+	cout << "OK\n";
+}
+
+
+void schedule_test() {
+	cout << "\n===== Testing failure schedules:\n";
+
+	babb::context fresh;	// no failure run left over from earlier tests
+	babb::context_scope in_fresh(fresh);
+	babb::this_thread.set_failure_profile(1, 1);
+	babb::this_thread.set_failure_schedule(babb::schedule::warmup(chrono::hours(1)));
+	for (int i = 0; i < 1000; ++i)
+		assert(!babb::this_thread.should_inject_random_failure() && "no failures during warm-up");
+
+	babb::this_thread.set_failure_profile(numeric_limits<int>::max(), 1);
+	babb::this_thread.set_failure_schedule(babb::schedule::during_phases(1));
+	babb::begin_phase(chrono::hours(1));
+	babb::this_thread.set_failure_profile(numeric_limits<int>::max(), 1);	// re-read the clock now
+	for (int i = 0; i < 100; ++i)
+		assert(babb::this_thread.should_inject_random_failure() && "always fail during the phase");
+	babb::end_phase();
+	babb::this_thread.set_failure_profile(numeric_limits<int>::max(), 1);
+	int failures = 0;
+	for (int i = 0; i < 100; ++i)
+		failures += babb::this_thread.should_inject_random_failure();
+	assert(failures < 10 && "back to the base profile after the phase");
+	cout << "OK\n";
+}
+
+
+void mapped_path_test() {
+	cout << "\n===== Testing failure targets (mapped path only):\n";
+
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.set_failure_profile(1, 1);
+	babb::this_thread.set_failure_targets(babb::paths::mapped);
+	for (int i = 0; i < 100; ++i)
+		delete static_cast<int*>(keep = new int);		// small allocations are not targeted
+	int failures = 0;
+	for (int i = 0; i < 10; ++i) {
+		try { delete[] static_cast<char*>(keep = new char[babb::mapping.threshold]); }
+		catch (const bad_alloc &) { ++failures; }
+	}
+	assert((babb::mapping.threshold == 0 || failures > 0) && "large allocations are targeted");
+	cout << "OK\n";
+}
+
+
+void page_block_test() {
+	cout << "\n===== Testing resizable page blocks:\n";
+
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.pause(true);
+	const size_t mib = size_t(1) << 20;
+	char* p = static_cast<char*>(babb::pages::allocate(4 * mib));
+	assert(p && "allocated");
+	for (size_t i = 0; i < 4 * mib; i += 4096) p[i] = char(i / 4096);
+
+	p = static_cast<char*>(babb::pages::reallocate(p, 64 * mib));
+	assert(p && "grown");
+	for (size_t i = 0; i < 4 * mib; i += 4096) assert(p[i] == char(i / 4096) && "contents kept");
+	p[64 * mib - 1] = 1;
+
+	babb::this_thread.pause(false);
+	babb::this_thread.set_failure_profile(1, 1);
+	babb::this_thread.set_failure_targets(babb::paths::mapped);
+	assert(!babb::pages::reallocate(p, 128 * mib) && "growth can fail");
+	assert(p[0] == 0 && p[64 * mib - 1] == 1 && "and leaves the block alone");
+	p = static_cast<char*>(babb::pages::reallocate(p, mib));
+	assert(p && p[4096] == 1 && "shrinking never fails");
+	assert(babb::pages::reallocate(p, 2 * mib) == p && "nor does regrowing into kept pages");
+	babb::pages::deallocate(p);
+	cout << "OK\n";
+}
+
+
+#ifdef __cpp_aligned_new
+struct frees_at_exit {
+	void* block = nullptr;
+	~frees_at_exit() {
+		if (!block) return;
+		::operator delete(block, align_val_t(64));
+		::operator delete(keep = ::operator new(64, align_val_t(64)), align_val_t(64));
+	}
+};
+thread_local frees_at_exit slab_at_exit;
+#endif
+
+void scavenger_test() {
+	cout << "\n===== Testing the scavenger:\n";
+#ifdef __cpp_aligned_new
+	if (!babb::scavenger::start(chrono::milliseconds(1))) { cout << "not available\n"; return; }
+	babb::scavenger::stop();
+
+	// A thread that exits leaves its free blocks in the depot
+	const int n = 3000;
+	auto churn = [] {
+		babb::this_thread.pause(true);
+		static void* blocks[n];
+		for (auto& b : blocks) b = ::operator new(64, align_val_t(64));
+		for (auto& b : blocks) ::operator delete(b, align_val_t(64));
+	};
+	thread(churn).join();
+
+	auto before = babb::scavenger::stats();
+	babb::scavenger::scavenge(size_t(1) << 40);
+	assert(babb::scavenger::stats().slabs_released == before.slabs_released && "keep_bytes is respected");
+	babb::scavenger::scavenge();
+	auto after = babb::scavenger::stats();
+	assert(after.passes == before.passes + 2);
+	assert(after.slabs_released >= before.slabs_released + 2 && "fully free slabs are released");
+	assert(after.bytes_returned > before.bytes_returned);
+
+	thread(churn).join();		// released slabs are reused
+
+	// Passes on the worker and on this thread overlap with each other and
+	// with exiting threads, and still never hand out a block twice
+	auto refill = [] {
+		babb::this_thread.pause(true);
+		uintptr_t* blocks[500];
+		for (auto& b : blocks) *(b = static_cast<uintptr_t*>(::operator new(64, align_val_t(64)))) = uintptr_t(&b);
+		for (auto& b : blocks) assert(*b == uintptr_t(&b) && "each block is handed out once");
+		for (auto& b : blocks) ::operator delete(b, align_val_t(64));
+	};
+	babb::scavenger::start(chrono::milliseconds(1));
+	thread churners[3];
+	for (auto& t : churners) t = thread([&] { for (int i = 0; i < 30; ++i) thread(refill).join(); });
+	for (int i = 0; i < 300; ++i) babb::scavenger::scavenge();
+	for (auto& t : churners) t.join();
+	babb::scavenger::stop();
+	thread(refill).join();
+
+	// A thread that only frees spills what it frees to the depot, so passes
+	// can return it while the thread still runs
+	babb::scavenger::scavenge();
+	static void* handed[5000];
+	thread([] {
+		babb::this_thread.pause(true);
+		for (auto& b : handed) b = ::operator new(64, align_val_t(64));
+	}).join();
+	auto held = babb::scavenger::stats();
+	atomic<int> stage{0};
+	thread consumer([&] {
+		babb::this_thread.pause(true);
+		for (auto& b : handed) ::operator delete(b, align_val_t(64));
+		stage = 1;
+		while (stage != 2) this_thread::yield();
+	});
+	while (stage != 1) this_thread::yield();
+	babb::scavenger::scavenge();
+	assert(babb::scavenger::stats().slabs_released > held.slabs_released && "a consumer does not hoard");
+	stage = 2;
+	consumer.join();
+
+	// Blocks freed and allocated after the thread's cache is gone
+	thread([] {
+		slab_at_exit.block = nullptr;		// constructed first, so destroyed last
+		babb::this_thread.pause(true);
+		slab_at_exit.block = ::operator new(64, align_val_t(64));
+	}).join();
+	thread(refill).join();
+
+	cout << after.bytes_returned - before.bytes_returned << " bytes returned\nOK\n";
+#else
+	cout << "not available\n";
+#endif
+}
+
+
+void trace_log_test() {
+	cout << "\n===== Testing the binary log (record, then read back):\n";
+
+	const char* path = "test_trace.babblog";
+	if (!babb::trace::start(path)) { cout << "not available\n"; return; }
+	{
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.set_failure_profile(1, 1);
+	for (int i = 0; i < 10; ++i) {
+		try { delete static_cast<int*>(keep = new int); }
+		catch (const bad_alloc &) { }
+	}
+	babb::this_thread.pause(true);
+	for (int i = 0; i < 10; ++i)
+		delete static_cast<int*>(keep = new int);
+	}
+	// One thread exits while recording, one is still alive at stop()
+	atomic<int> stage{0};
+	auto allocate = [&] {
+		babb::this_thread.pause(true);
+		for (int i = 0; i < 10; ++i)
+			delete static_cast<int*>(keep = new int);
+		stage.fetch_add(1);
+	};
+	thread([&] { allocate(); }).join();
+	thread alive([&] {
+		allocate();
+		while (stage.load() != 3) this_thread::yield();
+	});
+	while (stage.load() != 2) this_thread::yield();
+	babb::trace::stop();
+	stage.store(3);
+	alive.join();
+
+	babb::pause_guard pause(babb::this_thread);
+	babb::binlog::reader in(path);
+	assert(in.ok() && "log header is valid");
+	int allocs = 0, frees = 0, injected = 0;
+	uint32_t threads = 0;
+	babb::binlog::event e;
+	while (in.next(e)) {
+		allocs += e.tag == babb::binlog::tag_alloc;
+		frees += e.tag == babb::binlog::tag_free;
+		injected += e.tag == babb::binlog::tag_inject;
+		threads = max(threads, e.thread + 1);
+	}
+	assert(!in.damaged() && in.skipped_chunks() == 0 && "log reads back cleanly");
+	// the still-running thread frees its std::thread state after stop()
+	assert(allocs >= 30 && frees >= 30 && allocs - frees <= 1 && "every allocation and free is recorded");
+	assert(threads >= 3 && "every thread's events are recorded");
+	assert(injected == 10 && "every injected failure is recorded");
+	unsigned char raw[12] = {};
+	FILE* f = fopen(path, "rb");
+	assert(f && fread(raw, 1, sizeof(raw), f) == sizeof(raw));
+	fclose(f);
+	assert(raw[8] == babb::binlog::version && raw[9] == 0 && raw[10] == 0 && raw[11] == 0 && "the version is stored little-endian");
+	remove(path);
+	cout << "OK\n";
+}
+
+
+// Injects failures from a thread_local destructor, after babb's own have run
+struct injects_at_exit {
+	int n = 0;
+	~injects_at_exit() {
+		babb::this_thread.set_failure_profile(1, 1);
+		for (int i = 0; i < n; ++i) {
+			try { keep = new int; }
+			catch (const bad_alloc &) { }
+		}
+	}
+};
+thread_local injects_at_exit at_exit;
+
+void injection_log_test() {
+	cout << "\n===== Testing the injection event log:\n";
+
+	const char* path = "test_injections.babblog";
+	if (!babb::injection_log::start(path, chrono::hours(1))) { cout << "not available\n"; return; }
+	auto inject = [](int n) {
+		babb::state_guard save(babb::this_thread);
+		babb::this_thread.set_failure_profile(1, 1);
+		for (int i = 0; i < n; ++i) {
+			try { keep = new int; }
+			catch (const bad_alloc &) { }
+		}
+	};
+	inject(100);
+	{
+	babb::pause_guard pause(babb::this_thread);
+	thread([&] { inject(50); }).join();
+	}
+	babb::injection_log::stop();
+
+	auto logged = babb::injection_log::stats();
+	{
+	babb::pause_guard pause(babb::this_thread);
+	babb::binlog::reader in(path);
+	assert(in.ok() && "log header is valid");
+	uint64_t injected = 0;
+	babb::binlog::event e;
+	while (in.next(e)) injected += e.tag == babb::binlog::tag_inject && e.path == babb::paths::heap;
+	assert(!in.damaged() && in.header().ticks_per_second > 0 && "log reads back cleanly");
+	assert(injected == 150 && logged.written == 150 && logged.dropped == 0 && "both threads' failures are logged");
+	}
+
+	// Failures injected after the thread's ring is given up are not logged
+	babb::injection_log::start(path, chrono::milliseconds(1));
+	{
+	babb::pause_guard pause(babb::this_thread);
+	thread([&] {
+		at_exit.n = 1000;		// constructed first, so destroyed last
+		inject(10);
+	}).join();
+	}
+	this_thread::sleep_for(chrono::milliseconds(20));	// let the flusher free the ring
+	babb::injection_log::stop();
+	logged = babb::injection_log::stats();
+	assert(logged.written == 10 && "nothing is logged into a ring its thread gave up");
+
+	// Threads come and go while the flusher drains and frees their rings
+	babb::injection_log::start(path, chrono::milliseconds(1));
+	{
+	babb::pause_guard pause(babb::this_thread);
+	for (int wave = 0; wave < 8; ++wave) {
+		vector<thread> threads;
+		for (int i = 0; i < 8; ++i) threads.emplace_back([&] { inject(20); });
+		for (auto& t : threads) t.join();
+	}
+	}
+	babb::injection_log::stop();
+	logged = babb::injection_log::stats();
+	assert(logged.written == 8 * 8 * 20 && logged.dropped == 0 && "registering never loses a ring");
+
+	// With no flush in between, a thread can only hold as many as its ring
+	babb::injection_log::start(path, chrono::hours(1));
+	inject(10000);
+	babb::injection_log::stop();
+	logged = babb::injection_log::stats();
+	assert(logged.dropped > 0 && logged.written + logged.dropped == 10000 && "a full ring drops and counts");
+	remove(path);
+	cout << "OK\n";
+}
+
+
+// Whether the heap profile at path has a stack with exactly these counts
+bool profile_has(const char* path, long long live_count, long long live_bytes, long long alloc_count, long long alloc_bytes) {
+	FILE* in = fopen(path, "r");
+	if (!in) return false;
+	char line[4096];
+	long long c[4];
+	bool found = false;
+	while (!found && fgets(line, sizeof(line), in))
+		found = sscanf(line, "%lld: %lld [%lld: %lld] @", &c[0], &c[1], &c[2], &c[3]) == 4
+			&& c[0] == live_count && c[1] == live_bytes && c[2] == alloc_count && c[3] == alloc_bytes;
+	fclose(in);
+	return found;
+}
+
+void heap_profile_test() {
+	cout << "\n===== Testing the sampling heap profiler:\n";
+
+	babb::pause_guard pause(babb::this_thread);
+	const char* path = "test_heap.prof";
+	if (!babb::heap_profile::start(1)) { cout << "not available\n"; return; }
+	char* volatile blocks[100];
+	for (auto& b : blocks) b = new char[1000];
+	babb::heap_profile::stop();
+	assert(babb::heap_profile::write(path) && profile_has(path, 100, 100000, 100, 100000) && "every block sampled, at one stack");
+	for (auto& b : blocks) delete[] b;
+	assert(babb::heap_profile::write(path) && profile_has(path, 0, 0, 100, 100000) && "freed blocks leave the live heap");
+
+	char header[256] = "";
+	FILE* in = fopen(path, "r");
+	assert(in && fgets(header, sizeof(header), in) && strstr(header, "heap profile:") == header
+		&& strstr(header, "@ heap_v2/1\n") && "pprof's legacy heap profile header");
+	fclose(in);
+
+	// 1000-byte blocks every 64 KiB on average: about 1.5% of them
+	constexpr int N = 20000;
+	babb::heap_profile::start(64 << 10);
+	for (int i = 0; i < N; ++i) {
+		keep = new char[1000];
+		delete[] static_cast<char*>(keep);
+	}
+	babb::heap_profile::stop();
+	auto profiled = babb::heap_profile::stats();
+	assert(profiled.sampled > 200 && profiled.sampled < 420 && profiled.dropped == 0 && "sampled by bytes allocated");
+	remove(path);
+	cout << "OK (" << profiled.sampled << " of " << N << " sampled)\n";
+}
+
+
+template<class Policy>
+int run_of(int n, double u) {
+	Policy run;
+	run.begin(n, u);
+	int length = 0;
+	for (; run.running() && length < 1000000; ++length) run.step();
+	return length;
+}
+
+void run_length_test() {
+	cout << "\n===== Testing run-length policies:\n";
+
+	namespace rl = babb::run_lengths;
+	assert(run_of<rl::fixed>(5, .3) == 5 && "fixed runs are exactly run_length long");
+	assert(run_of<rl::uniform>(5, .01) == 1 && run_of<rl::uniform>(5, .99) == 5 && run_of<rl::uniform>(5, 1.) == 5
+		&& "uniform runs cover [1, run_length]");
+	assert(run_of<rl::geometric>(1, .5) == 1 && run_of<rl::geometric>(4, 1.) == 1 && run_of<rl::geometric>(4, 1e-6) > 20
+		&& "geometric runs are at least 1 and occasionally long");
+
+	rl::until_frees run;
+	run.begin(3, .5);
+	for (int i = 0; i < 100; ++i) run.step();
+	assert(run.running() && "failures alone do not end an until_frees run");
+	run.freed(16), run.freed(16);
+	assert(run.running());
+	run.freed(16);
+	assert(!run.running() && "three frees end a run of 3");
+	cout << "OK\n";
+}
+
+
+void decision_test() {
+	cout << "\n===== Testing batched run-start decisions:\n";
+
+	babb::context fresh;
+	babb::context_scope in_fresh(fresh);
+	babb::this_thread.set_failure_profile(numeric_limits<int>::max(), 1);
+	for (int i = 0; i < 10; ++i)
+		assert(!babb::this_thread.should_inject_random_failure());
+	babb::this_thread.set_failure_profile(1, 1);
+	assert(babb::this_thread.should_inject_random_failure() && "decisions made for the old profile are dropped");
+
+	constexpr int N = 200000;
+	babb::this_thread.set_failure_profile(100, 1);
+	int failures = 0;
+	for (int i = 0; i < N; ++i)
+		failures += babb::this_thread.should_inject_random_failure();
+	assert(failures > N / 100 * 8 / 10 && failures < N / 100 * 12 / 10 && "about one run start per 100 checks");
+	cout << "OK (" << failures << " failures in " << N << " checks)\n";
+}
+
+
+void recovery_test() {
+	cout << "\n===== Testing free-driven recovery:\n";
+
+	babb::state_guard save(babb::this_thread);
+	char* blocks[4];
+	{
+	babb::pause_guard pause(babb::this_thread);
+	for (auto& b : blocks) b = new char[1024];
+	}
+	babb::this_thread.set_failure_profile(1, 1);
+	babb::this_thread.set_recovery(4096);
+	for (int i = 0; i < 100; ++i)
+		assert(babb::this_thread.should_inject_random_failure() && "a run lasts until memory is freed");
+	babb::this_thread.set_failure_profile(numeric_limits<int>::max(), 1);
+	for (int i = 0; i < 3; ++i) delete[] blocks[i];
+	assert(babb::this_thread.should_inject_random_failure() && "3 KiB freed is not enough");
+	delete[] blocks[3];
+	assert(!babb::this_thread.should_inject_random_failure() && "4 KiB freed ends the run");
+	cout << "OK\n";
+}
+
+
+void delay_test() {
+	cout << "\n===== Testing latency injection:\n";
+
+	babb::context fresh;
+	babb::context_scope in_fresh(fresh);
+	babb::this_thread.set_failure_profile(numeric_limits<int>::max(), 1);
+	assert(babb::this_thread.delay_for(16).count() == 0 && "no delays by default");
+
+	babb::this_thread.set_delay_profile(1, chrono::microseconds(50));
+	assert(babb::this_thread.delay_for(16) == chrono::microseconds(50));
+	babb::this_thread.set_delay_sizes(1024);
+	assert(babb::this_thread.delay_for(16).count() == 0 && "too small to delay");
+	assert(babb::this_thread.delay_for(4096) == chrono::microseconds(50));
+	{
+	babb::pause_guard pause(babb::this_thread);
+	assert(babb::this_thread.delay_for(4096).count() == 0 && "never delayed while paused");
+	}
+
+	constexpr int N = 20000;
+	babb::this_thread.set_delay_profile(1, chrono::microseconds(50), 1, babb::delays::spin, babb::delays::exponential);
+	double total = 0;
+	for (int i = 0; i < N; ++i)
+		total += double(babb::this_thread.delay_for(4096).count());
+	assert(total / N > 45000 && total / N < 55000 && "exponential delays average the mean");
+
+	babb::this_thread.set_delay_profile(100, chrono::microseconds(50), 10);
+	int delayed = 0, bursts = 0;
+	bool previous = false;
+	for (int i = 0; i < N * 10; ++i) {
+		bool now = babb::this_thread.delay_for(4096).count() != 0;
+		delayed += now;
+		bursts += now && !previous;
+		previous = now;
+	}
+	assert(delayed > N / 10 * 7 / 10 && delayed < N / 10 * 13 / 10 && "about one delay per 100 allocations");
+	assert(delayed >= (bursts - 1) * 10 && "delays come in bursts");
+
+	babb::this_thread.set_delay_profile(1, chrono::milliseconds(2), 1, babb::delays::sleep);
+	auto start = chrono::steady_clock::now();
+	keep = new char[4096];
+	delete[] static_cast<char*>(keep);
+	assert(chrono::steady_clock::now() - start >= chrono::milliseconds(2) && "operator new waits");
+	cout << "OK (" << delayed << " delays in " << bursts << " bursts in " << N * 10 << " allocations)\n";
+}
+
+
+void oom_event_test() {
+	cout << "\n===== Testing process-wide OOM events:\n";
+
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.set_failure_profile(numeric_limits<int>::max(), 1);
+	babb::this_thread.set_oom_events(chrono::hours(1));
+	babb::context task;
+	task.set_failure_profile(numeric_limits<int>::max(), 1);
+	task.set_oom_events(chrono::hours(1));
+	assert(!babb::this_thread.should_inject_random_failure() && !task.should_inject_random_failure());
+
+	babb::raise_oom_event(chrono::hours(1));
+	for (int i = 0; i < 100; ++i)
+		assert(babb::this_thread.should_inject_random_failure() && task.should_inject_random_failure()
+			&& "everyone taking part fails during an event");
+	babb::end_oom_event();
+	assert(!babb::this_thread.should_inject_random_failure() && !task.should_inject_random_failure()
+		&& "and recovers when it ends");
+	cout << "OK\n";
+}
+
+
+struct sized_failure {
+	size_t requested;
+	explicit sized_failure(size_t n) : requested(n) { }
+};
+
+void channel_test() {
+	cout << "\n===== Testing failure channels:\n";
+
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.set_failure_profile(1, 1);
+	try { babb::this_thread.inject_random_failure<sized_failure>(42); assert(!"should have thrown"); }
+	catch (const sized_failure& e) { assert(e.requested == 42 && "exception carries the size"); }
+	try { babb::this_thread.inject_random_failure(42); assert(!"should have thrown"); }
+	catch (const bad_alloc&) { }
+	assert(babb::this_thread.inject_random_error() == errc::not_enough_memory);
+	size_t seen = 0;
+	assert(babb::this_thread.inject_random_failure_with([&](size_t n) { seen = n; }, 7) && seen == 7);
+
+	babb::this_thread.pause(true);
+	assert(!babb::this_thread.inject_random_error() && "no error while paused");
+	assert(!babb::this_thread.inject_random_failure_with([&](size_t) { assert(!"not called"); }));
+	cout << "OK\n";
+}
+
+
+struct allocates_on_unwind {
+	~allocates_on_unwind() { babb::pause_guard pause(babb::this_thread); int* volatile p = new int; delete p; }
+};
+
+void probe_test() {
+	cout << "\n===== Testing tracepoints with their semaphores raised:\n";
+#ifdef BABB_HAS_PROBES
+	// What a tracer does on attach; without one the probe sites are nops
+	++babb_decide_semaphore, ++babb_inject_semaphore, ++babb_new_semaphore, ++babb_delete_semaphore;
+	{
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.set_failure_profile(2, 1);
+	int failures = 0;
+	for (int i = 0; i < 100; ++i) {
+		try { int* volatile p = new int; delete p; }
+		catch (const bad_alloc&) { ++failures; }
+	}
+	assert(failures > 0 && failures < 100 && "probes do not change behavior");
+	}
+	--babb_decide_semaphore, --babb_inject_semaphore, --babb_new_semaphore, --babb_delete_semaphore;
+	cout << "OK\n";
+#else
+	cout << "not available\n";
+#endif
+}
+
+
+// Inlines all it can into itself, as an optimizer may at any call site
+#if defined(__GNUC__)
+__attribute__((flatten))
+#endif
+void throws_twice() {
+	try { babb::this_thread.inject_random_failure(); }
+	catch (const bad_alloc &) { babb::unwind_costs::caught(); }
+	try { babb::this_thread.inject_random_failure(); }
+	catch (const bad_alloc &) { babb::unwind_costs::caught(); }
+}
+
+void unwind_cost_test() {
+	cout << "\n===== Testing unwind cost probes:\n";
+
+	babb::unwind_costs::reset();
+	babb::unwind_costs::enable(true);
+	{
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.set_failure_profile(1, 1);
+	try { allocates_on_unwind a; int* volatile p = new int; delete p; }
+	catch (const bad_alloc &) { babb::unwind_costs::caught(); }
+	}
+	babb::unwind_costs::enable(false);
+
+	uint64_t throws = 0, probed = 0, allocations = 0;
+	for (auto& s : babb::detail::unwind_sites) {
+		throws += s.throws;
+		probed += s.probed;
+		allocations += s.allocations;
+	}
+	assert(throws == 1 && probed == 1 && "the throw and its catch were seen");
+	assert(allocations == 1 && "the allocation in the destructor happened while unwinding");
+
+	// Each call site is its own entry, however much of the call is inlined
+	babb::unwind_costs::reset();
+	babb::unwind_costs::enable(true);
+	{
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.set_failure_profile(1, 1);
+	throws_twice();
+	}
+	babb::unwind_costs::enable(false);
+
+	int sites = 0;
+	for (auto& s : babb::detail::unwind_sites) sites += s.throws != 0;
+	assert(sites == 2 && "two call sites, two entries");
+	cout << "OK\n";
+}
+
+
+struct survives_failure_on_unwind {
+	bool& failed;
+	~survives_failure_on_unwind() {
+		try { int* volatile p = new int; delete p; }
+		catch (const bad_alloc &) { failed = true; }
+	}
+};
+
+void unwind_allocation_test() {
+	cout << "\n===== Testing allocations during unwinding:\n";
+
+	babb::unwind_allocations::reset();
+	babb::unwind_allocations::fail(true);
+	bool failed = false;
+	{
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.set_failure_profile(1, 1);
+	try { survives_failure_on_unwind s{failed}; int* volatile p = new int; delete p; }
+	catch (const bad_alloc &) { }
+	}
+	babb::unwind_allocations::fail(false);
+	assert(babb::unwind_allocations::total() == 1 && "the destructor's allocation was seen");
+	assert(failed && "and was failed");
+
+	int* volatile p = new int;	// no longer unwinding
+	delete p;
+	assert(babb::unwind_allocations::total() == 1);
+
+	// Nothrow new fails without starting an unwind, while a thrown failure
+	// starts one on the mapped path as on the heap path
+	{
+	babb::state_guard save(babb::this_thread);
+	babb::this_thread.set_failure_profile(1, 1);
+	babb::this_thread.set_failure_targets(babb::paths::heap | babb::paths::mapped);
+	assert(!(keep = new (nothrow) int) && !babb::detail::in_flight.active);
+	assert(!(keep = new (nothrow) int[4]) && !babb::detail::in_flight.active);
+	assert(!(keep = new (nothrow) char[size_t(1) << 20]) && !babb::detail::in_flight.active);
+#ifdef __cpp_aligned_new
+	struct alignas(64) line { char c[64]; };
+	assert(!(keep = new (nothrow) line) && !babb::detail::in_flight.active);
+	assert(!(keep = new (nothrow) line[2]) && !babb::detail::in_flight.active);
+#endif
+	if (babb::mapping.threshold) {
+		try { keep = new char[babb::mapping.threshold]; assert(!"should have thrown"); }
+		catch (const bad_alloc &) { assert(babb::detail::in_flight.active); babb::unwind_costs::caught(); }
+	}
+	}
+	cout << "OK\n";
+}
+
+
 int main() { 
+	// Only inject on the main thread where a test sets a profile of its own,
+	// so that one test's bookkeeping does not fail at random
+	babb::this_thread.set_failure_profile(numeric_limits<int>::max(), 1);
+
 	smoke_test();
+	context_test();
+	schedule_test();
+	mapped_path_test();
+	page_block_test();
+	scavenger_test();
+	trace_log_test();
+	injection_log_test();
+	heap_profile_test();
+	run_length_test();
+	decision_test();
+	recovery_test();
+	delay_test();
+	oom_event_test();
+	channel_test();
+	probe_test();
+	unwind_cost_test();
+	unwind_allocation_test();
 }